@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+
+/* objects per chunk follow from the chunk size */
+#define SLAB_CHUNK	(64*1024)
+
+static int slab_grow(struct slab *slab)
+{
+	char *chunk;
+	int j, n;
+
+	n = SLAB_CHUNK / slab->size;
+	if (!n)
+		n = 1;
+	chunk = malloc(n * slab->size);
+	if (!chunk)
+		return -1;
+	/* link in reverse, so the first object comes first */
+	for (j = n-1; j >= 0; --j) {
+		*(void **)(chunk + j*slab->size) = slab->freelist;
+		slab->freelist = chunk + j*slab->size;
+	}
+	++slab->nchunks;
+	return 0;
+}
+
+void *slab_alloc(struct slab *slab)
+{
+	void *obj;
+
+	if (!slab->freelist && slab_grow(slab) < 0)
+		return NULL;
+	obj = slab->freelist;
+	slab->freelist = *(void **)obj;
+	memset(obj, 0, slab->size);
+	++slab->nused;
+	return obj;
+}
+
+void slab_free(struct slab *slab, void *obj)
+{
+	if (!obj)
+		return;
+	*(void **)obj = slab->freelist;
+	slab->freelist = obj;
+	--slab->nused;
+}
+
+size_t slab_bytes(const struct slab *slab)
+{
+	size_t n = SLAB_CHUNK / slab->size;
+
+	return slab->nchunks * (n ?: 1) * slab->size;
+}
+
+/* size classes are powers of 2, from 16 bytes */
+#define ARENA_MINSHIFT	4
+#define ARENA_BLOCK	(64*1024)
+
+static int arena_class(size_t size)
+{
+	int cls;
+
+	for (cls = 0; cls < ARENA_NCLASS; ++cls) {
+		if (size <= ((size_t)1 << (cls + ARENA_MINSHIFT)))
+			return cls;
+	}
+	/* too large, use malloc */
+	return -1;
+}
+
+char *arena_alloc(struct arena *arena, size_t size)
+{
+	size_t csize;
+	char *str;
+	int cls;
+
+	cls = arena_class(size);
+	if (cls < 0)
+		return malloc(size);
+	if (arena->freelist[cls]) {
+		str = arena->freelist[cls];
+		arena->freelist[cls] = *(void **)str;
+		return str;
+	}
+	csize = (size_t)1 << (cls + ARENA_MINSHIFT);
+	if (arena->left < csize) {
+		/* the tail of the old block is lost */
+		arena->block = malloc(ARENA_BLOCK);
+		if (!arena->block) {
+			arena->left = 0;
+			return NULL;
+		}
+		arena->left = ARENA_BLOCK;
+		++arena->nblocks;
+	}
+	str = arena->block;
+	arena->block += csize;
+	arena->left -= csize;
+	return str;
+}
+
+void arena_free(struct arena *arena, char *str, size_t size)
+{
+	int cls;
+
+	if (!str)
+		return;
+	cls = arena_class(size);
+	if (cls < 0) {
+		free(str);
+		return;
+	}
+	*(void **)str = arena->freelist[cls];
+	arena->freelist[cls] = str;
+}
+
+size_t arena_bytes(const struct arena *arena)
+{
+	/* strings beyond the size classes are not counted */
+	return (size_t)arena->nblocks * ARENA_BLOCK;
+}
+
+char *arena_strndup(struct arena *arena, const char *str, int len, int extra)
+{
+	char *dup;
+
+	dup = arena_alloc(arena, len + 1 + extra);
+	if (!dup)
+		return NULL;
+	memcpy(dup, str, len);
+	dup[len] = 0;
+	return dup;
+}
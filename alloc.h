@@ -0,0 +1,43 @@
+#ifndef _alloc_h_
+#define _alloc_h_
+
+#include <stddef.h>
+
+/* fixed size objects, carved from large chunks
+ * Freed objects are recycled, chunks are kept.
+ * Adjacent allocations are adjacent in memory.
+ */
+struct slab {
+	size_t size;
+	void *freelist;
+	int nused;
+	int nchunks;
+};
+#define SLAB_INIT(type)	{ .size = (sizeof(type) + 7) & ~7, }
+
+/* return a zeroed object, NULL when out of memory */
+extern void *slab_alloc(struct slab *slab);
+extern void slab_free(struct slab *slab, void *obj);
+/* memory of the chunks, used or not */
+extern size_t slab_bytes(const struct slab *slab);
+
+/* strings, packed in large blocks, per size class
+ * Freeing requires the size that was allocated.
+ */
+#define ARENA_NCLASS	8
+struct arena {
+	char *block;
+	size_t left;
+	void *freelist[ARENA_NCLASS];
+	int nblocks;
+};
+
+/* return @size bytes, NULL when out of memory */
+extern char *arena_alloc(struct arena *arena, size_t size);
+extern void arena_free(struct arena *arena, char *str, size_t size);
+/* copy @len bytes of @str, with @extra bytes spare room after the null terminator */
+extern char *arena_strndup(struct arena *arena, const char *str, int len, int extra);
+/* memory of the blocks, used or not */
+extern size_t arena_bytes(const struct arena *arena);
+
+#endif
@@ -0,0 +1,438 @@
+/*
+ * In-process replacement of libmosquitto, for benchmarking.
+ *
+ * It plays the broker: once the daemon subscribes, it replays
+ * BENCH_N synthetic items as retained messages, and it times
+ * what the daemon publishes in return.
+ * One line of key=value results is written to stdout, then it exits.
+ *
+ * environment:
+ * BENCH_MODE	alrm (default), fire or timer
+ * BENCH_N	number of items (default 1000)
+ * BENCH_BATCH	messages delivered per mosquitto_loop_read (default 64)
+ * BENCH_PROG	name of the run in the results (default program name)
+ *
+ * alrm:	N alarms far from now, measure the startup until all
+ *		alarms/NAME/next are published
+ * fire:	N alarms on the next minute, measure the latency from the
+ *		minute until each alarms/NAME/state is published
+ * timer:	N timers of 0.5s, all set right away, measure the latency
+ *		from the delivery + 0.5s until each is reset
+ */
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <mosquitto.h>
+
+#define TIMER_DELAY	0.5
+
+struct mosquitto {
+	int fd;
+	void *obj;
+	void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *);
+	void (*on_connect)(struct mosquitto *, void *, int, int);
+	void (*on_connect_v5)(struct mosquitto *, void *, int, int, const mosquitto_property *);
+	void (*on_subscribe)(struct mosquitto *, void *, int, int, const int *);
+	int connected;
+	/* SUBSCRIBEs sent resp. acknowledged */
+	int lastmid, ackedmid;
+};
+
+static struct {
+	enum { ALRM, FIRE, TIMER, } mode;
+	const char *modestr;
+	int n;
+	int batch;
+	/* messages to deliver */
+	int nmsgs, ndelivered;
+	int generated;
+	/* mqttalrm/fire: alarm time */
+	time_t firetime;
+	int firehhmm;
+	/* timestamps */
+	double tconnect, tfirst, tlast, tsettled;
+	double cbtime;
+	size_t mem0, mem1;
+	/* results */
+	int ndone;
+	double lagsum, lagmax, lagmin;
+	double *tset;
+	int npubs;
+} s;
+
+static double monotime(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+static double realtime(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_REALTIME, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+static size_t heapused(void)
+{
+	struct mallinfo2 mi = mallinfo2();
+
+	return mi.uordblks;
+}
+
+static void report(void)
+{
+	printf("prog=%s mode=%s n=%i msgs=%i", getenv("BENCH_PROG") ?: program_invocation_short_name,
+			s.modestr, s.n, s.ndelivered);
+	printf(" load_ms=%.3lf msg_us=%.3lf", (s.tlast - s.tfirst)*1e3,
+			s.ndelivered ? s.cbtime*1e6/s.ndelivered : 0);
+	printf(" mem_per_item=%.0lf", s.n ? ((double)s.mem1 - s.mem0)/s.n : 0);
+	if (s.mode == ALRM)
+		printf(" settle_ms=%.3lf", (s.tsettled - s.tconnect)*1e3);
+	else
+		printf(" lag_min_ms=%.3lf lag_avg_ms=%.3lf lag_max_ms=%.3lf",
+				s.lagmin*1e3, s.ndone ? s.lagsum*1e3/s.ndone : 0, s.lagmax*1e3);
+	printf(" publishes=%i\n", s.npubs);
+	fflush(stdout);
+	exit(0);
+}
+
+static void lag(double value)
+{
+	if (!s.ndone || value < s.lagmin)
+		s.lagmin = value;
+	if (value > s.lagmax)
+		s.lagmax = value;
+	s.lagsum += value;
+	if (++s.ndone >= s.n)
+		report();
+}
+
+static void generate(void)
+{
+	const char *str;
+	struct tm tm;
+	time_t now;
+
+	s.generated = 1;
+	str = getenv("BENCH_MODE") ?: "alrm";
+	s.modestr = str;
+	if (!strcmp(str, "fire"))
+		s.mode = FIRE;
+	else if (!strcmp(str, "timer"))
+		s.mode = TIMER;
+	else if (!strcmp(str, "alrm"))
+		s.mode = ALRM;
+	else {
+		fprintf(stderr, "BENCH_MODE %s unknown\n", str);
+		exit(1);
+	}
+	s.n = strtoul(getenv("BENCH_N") ?: "1000", NULL, 0);
+	s.batch = strtoul(getenv("BENCH_BATCH") ?: "64", NULL, 0) ?: 1;
+	/* alarm/repeat, or timer spec/value per item */
+	s.nmsgs = s.n*2;
+
+	time(&now);
+	if (s.mode == FIRE) {
+		/* the next minute, leave time to load */
+		s.firetime = (now / 60 + 1) * 60;
+		if (s.firetime - now < 5)
+			s.firetime += 60;
+	} else
+		/* far enough to never fire */
+		s.firetime = now + 12*3600;
+	localtime_r(&s.firetime, &tm);
+	s.firehhmm = tm.tm_hour*100 + tm.tm_min;
+	if (s.mode == TIMER)
+		s.tset = calloc(s.n, sizeof(*s.tset));
+	s.mem0 = heapused();
+}
+
+static void deliver(struct mosquitto *mosq, int idx)
+{
+	struct mosquitto_message msg = { .qos = 1, .retain = 1, };
+	char topic[64], payload[32];
+	int item = idx / 2;
+	double t0;
+
+	if (s.mode == TIMER) {
+		if (idx & 1) {
+			sprintf(topic, "bench/t%i", item);
+			strcpy(payload, "1");
+			/* a live set, not a retained value */
+			msg.retain = 0;
+		} else {
+			sprintf(topic, "bench/t%i/timer", item);
+			sprintf(payload, "%.1lf 0", TIMER_DELAY);
+		}
+	} else if (idx & 1) {
+		sprintf(topic, "alarms/a%i/repeat", item);
+		strcpy(payload, "mtwtfss");
+	} else {
+		sprintf(topic, "alarms/a%i/alarm", item);
+		sprintf(payload, "%02i:%02i", s.firehhmm / 100, s.firehhmm % 100);
+	}
+	msg.mid = idx + 1;
+	msg.topic = topic;
+	msg.payload = payload;
+	msg.payloadlen = strlen(payload);
+	t0 = monotime();
+	if (s.tset && (idx & 1))
+		s.tset[item] = t0;
+	mosq->on_message(mosq, mosq->obj, &msg);
+	s.cbtime += monotime() - t0;
+	++s.ndelivered;
+}
+
+/* API */
+int mosquitto_lib_init(void)
+{
+	return 0;
+}
+
+struct mosquitto *mosquitto_new(const char *id, bool clean, void *obj)
+{
+	struct mosquitto *mosq;
+
+	mosq = calloc(1, sizeof(*mosq));
+	if (!mosq)
+		return NULL;
+	mosq->fd = eventfd(0, EFD_NONBLOCK);
+	if (mosq->fd < 0) {
+		free(mosq);
+		return NULL;
+	}
+	mosq->obj = obj;
+	return mosq;
+}
+
+static void wakeup(struct mosquitto *mosq)
+{
+	uint64_t val = 1;
+
+	if (write(mosq->fd, &val, sizeof(val)) < 0)
+		perror("eventfd");
+}
+
+static void quiet(struct mosquitto *mosq)
+{
+	uint64_t val;
+
+	if (read(mosq->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		perror("eventfd");
+}
+
+int mosquitto_connect(struct mosquitto *mosq, const char *host, int port, int keepalive)
+{
+	/* the CONNACK arrives with the first read */
+	wakeup(mosq);
+	return 0;
+}
+
+int mosquitto_reconnect(struct mosquitto *mosq)
+{
+	fprintf(stderr, "bench: unexpected reconnect\n");
+	exit(1);
+}
+
+int mosquitto_disconnect(struct mosquitto *mosq)
+{
+	return 0;
+}
+
+int mosquitto_will_set(struct mosquitto *mosq, const char *topic, int len, const void *payload, int qos, bool retain)
+{
+	return 0;
+}
+
+int mosquitto_int_option(struct mosquitto *mosq, enum mosq_opt_t option, int value)
+{
+	return 0;
+}
+
+void mosquitto_log_callback_set(struct mosquitto *mosq, void (*fn)(struct mosquitto *, void *, int, const char *))
+{
+}
+
+void mosquitto_message_callback_set(struct mosquitto *mosq, void (*fn)(struct mosquitto *, void *, const struct mosquitto_message *))
+{
+	mosq->on_message = fn;
+}
+
+void mosquitto_connect_with_flags_callback_set(struct mosquitto *mosq, void (*fn)(struct mosquitto *, void *, int, int))
+{
+	mosq->on_connect = fn;
+}
+
+void mosquitto_connect_v5_callback_set(struct mosquitto *mosq, void (*fn)(struct mosquitto *, void *, int, int, const mosquitto_property *))
+{
+	mosq->on_connect_v5 = fn;
+}
+
+void mosquitto_subscribe_callback_set(struct mosquitto *mosq, void (*fn)(struct mosquitto *, void *, int, int, const int *))
+{
+	mosq->on_subscribe = fn;
+}
+
+int mosquitto_subscribe(struct mosquitto *mosq, int *mid, const char *sub, int qos)
+{
+	return mosquitto_subscribe_multiple(mosq, mid, 1, (char *const *)&sub, qos, 0, NULL);
+}
+
+int mosquitto_subscribe_multiple(struct mosquitto *mosq, int *mid, int n, char *const *const subs, int qos, int options, const mosquitto_property *props)
+{
+	/* the SUBACK arrives with the next read */
+	if (mid)
+		*mid = mosq->lastmid+1;
+	++mosq->lastmid;
+	wakeup(mosq);
+	if (!s.generated) {
+		/* the broker replays the retained messages */
+		generate();
+		wakeup(mosq);
+	}
+	return 0;
+}
+
+int mosquitto_unsubscribe(struct mosquitto *mosq, int *mid, const char *sub)
+{
+	return 0;
+}
+
+int mosquitto_unsubscribe_multiple(struct mosquitto *mosq, int *mid, int n, char *const *const subs, const mosquitto_property *props)
+{
+	return 0;
+}
+
+static void published(const char *topic, int len, const void *payload)
+{
+	int tlen = topic ? strlen(topic) : 0;
+	double now;
+
+	++s.npubs;
+	if (!s.generated || !topic)
+		return;
+	if (s.mode == ALRM) {
+		if (tlen > 5 && !strcmp(topic+tlen-5, "/next") && len) {
+			if (++s.ndone >= s.n) {
+				s.tsettled = monotime();
+				s.mem1 = heapused();
+				report();
+			}
+		}
+	} else if (s.mode == FIRE) {
+		if (tlen > 6 && !strcmp(topic+tlen-6, "/state") && len == 2 && !memcmp(payload, "on", 2)) {
+			now = realtime();
+			if (!s.ndone)
+				s.mem1 = heapused();
+			lag(now - s.firetime);
+		}
+	} else if (!strncmp(topic, "bench/t", 7) && len == 1 && *(const char *)payload == '0') {
+		now = monotime();
+		lag(now - s.tset[strtoul(topic+7, NULL, 10)] - TIMER_DELAY);
+	}
+}
+
+int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic, int len, const void *payload, int qos, bool retain)
+{
+	published(topic, len, payload);
+	return 0;
+}
+
+int mosquitto_publish_v5(struct mosquitto *mosq, int *mid, const char *topic, int len, const void *payload, int qos, bool retain, const mosquitto_property *props)
+{
+	published(topic, len, payload);
+	return 0;
+}
+
+int mosquitto_property_add_int16(mosquitto_property **props, int id, uint16_t value)
+{
+	return 0;
+}
+
+int mosquitto_property_add_string_pair(mosquitto_property **props, int id, const char *name, const char *value)
+{
+	return 0;
+}
+
+void mosquitto_property_free_all(mosquitto_property **props)
+{
+	*props = NULL;
+}
+
+const mosquitto_property *mosquitto_property_read_int16(const mosquitto_property *props, int id, uint16_t *value, bool skip_first)
+{
+	return NULL;
+}
+
+int mosquitto_loop_read(struct mosquitto *mosq, int max_packets)
+{
+	static const int granted_qos = 0;
+	int j;
+
+	if (!mosq->connected) {
+		mosq->connected = 1;
+		s.tconnect = monotime();
+		quiet(mosq);
+		if (mosq->on_connect_v5)
+			mosq->on_connect_v5(mosq, mosq->obj, 0, 0, NULL);
+		else if (mosq->on_connect)
+			mosq->on_connect(mosq, mosq->obj, 0, 0);
+		return 0;
+	}
+	while (mosq->ackedmid < mosq->lastmid) {
+		++mosq->ackedmid;
+		if (mosq->on_subscribe)
+			mosq->on_subscribe(mosq, mosq->obj, mosq->ackedmid, 1, &granted_qos);
+	}
+	if (!s.tfirst)
+		s.tfirst = monotime();
+	for (j = 0; j < s.batch && s.ndelivered < s.nmsgs; ++j)
+		deliver(mosq, s.ndelivered);
+	if (s.ndelivered >= s.nmsgs) {
+		quiet(mosq);
+		if (!s.tlast)
+			s.tlast = monotime();
+		if (s.mode == TIMER && !s.mem1)
+			s.mem1 = heapused();
+	}
+	return 0;
+}
+
+int mosquitto_loop_write(struct mosquitto *mosq, int max_packets)
+{
+	return 0;
+}
+
+int mosquitto_loop_misc(struct mosquitto *mosq)
+{
+	return 0;
+}
+
+bool mosquitto_want_write(struct mosquitto *mosq)
+{
+	return false;
+}
+
+int mosquitto_socket(struct mosquitto *mosq)
+{
+	return mosq->fd;
+}
+
+const char *mosquitto_strerror(int err)
+{
+	return err ? "bench error" : "success";
+}
+
+const char *mosquitto_connack_string(int rc)
+{
+	return rc ? "bench refused" : "accepted";
+}
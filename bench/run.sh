@@ -0,0 +1,40 @@
+#!/bin/sh
+# run the benchmarks, one key=value line per run
+# BENCH_SIZES and BENCH_FIRE override the item counts
+
+BENCH_SIZES=${BENCH_SIZES:-"10 100 1000 10000 100000"}
+BENCH_FIRE=${BENCH_FIRE:-"1000"}
+DIR=$(dirname "$0")
+
+run() {
+	MODE=$1
+	N=$2
+	shift 2
+	BENCH_MODE=$MODE BENCH_N=$N "$@" 2>/dev/null || echo "prog=$1 mode=$MODE n=$N failed=$?"
+}
+
+echo "# $(git describe --tags --always 2>/dev/null) $(date -u +%Y-%m-%dT%H:%M:%SZ)"
+for N in $BENCH_SIZES; do
+	run alrm $N $DIR/mqttalrm
+done
+for N in $BENCH_SIZES; do
+	run timer $N $DIR/mqttimer
+done
+for N in $BENCH_SIZES; do
+	BENCH_PROG="mqttalrm-t" run timer $N $DIR/mqttalrm -t
+done
+# fire waits for the next minute
+for N in $BENCH_FIRE; do
+	run fire $N $DIR/mqttalrm
+done
+# replay regressions: TRACE with the expected output next to it,
+# and the options to replay it with
+replay() {
+	ZONE=$1
+	NAME=$2
+	shift 2
+	TZ=$ZONE $DIR/mqttalrm "$@" -R $DIR/$NAME.trace 2>/dev/null | cmp -s - $DIR/$NAME.out &&
+		echo "replay=$NAME ok" || echo "replay=$NAME failed"
+}
+replay America/Santiago santiago
+replay UTC failover -C g -i me
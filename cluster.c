@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <mosquitto.h>
+
+#include "common.h"
+#include "cluster.h"
+
+struct member {
+	struct member *next;
+	unsigned int hash;
+	char id[1];
+};
+
+static struct {
+	char *topic;
+	char *pattern;
+	/* length of the topic without ID */
+	int prefixlen;
+	const char *id;
+	unsigned int hash;
+	void (*changed)(void);
+	/* our own lease came back, the member list is complete */
+	int ready;
+	/* other members, sorted by ID */
+	struct member *members;
+} s;
+
+void cluster_init(const char *group, const char *id, void (*changed)(void))
+{
+	if (asprintf(&s.topic, "cluster/%s/%s", group, id) < 0 ||
+			asprintf(&s.pattern, "cluster/%s/+", group) < 0) {
+		syslog(LOG_ERR, "asprintf cluster topic failed");
+		exit(1);
+	}
+	s.prefixlen = strlen(s.pattern)-1;
+	s.id = id;
+	s.hash = strhash(id, strlen(id));
+	s.changed = changed;
+}
+
+const char *cluster_topic(void)
+{
+	return s.topic;
+}
+
+const char *cluster_pattern(void)
+{
+	return s.pattern;
+}
+
+void cluster_join(struct mosquitto *mosq, int qos)
+{
+	int ret;
+
+	/* don't use pubq, the lease must be sent, even if it is known */
+	ret = mosquitto_publish(mosq, NULL, s.topic, 1, "1", qos, 1);
+	if (ret)
+		syslog(LOG_WARNING, "mosquitto_publish %s: %s", s.topic, mosquitto_strerror(ret));
+}
+
+void cluster_leave(struct mosquitto *mosq, int qos)
+{
+	if (!s.ready)
+		return;
+	s.ready = 0;
+	mosquitto_publish(mosq, NULL, s.topic, 0, NULL, qos, 1);
+}
+
+int cluster_msg(struct mosquitto *mosq, const char *topic, const void *payload, int len, int qos)
+{
+	struct member **pm, *m;
+	const char *id;
+	int cmp;
+
+	if (!s.topic || strncmp(topic, s.pattern, s.prefixlen))
+		return 0;
+	id = topic + s.prefixlen;
+	if (!strcmp(id, s.id)) {
+		if (len && !s.ready) {
+			syslog(LOG_NOTICE, "joined cluster as %s", s.id);
+			s.ready = 1;
+		} else if (!len && s.ready) {
+			/* an old will removed our lease, renew it */
+			syslog(LOG_WARNING, "lost cluster lease %s", s.topic);
+			s.ready = 0;
+			cluster_join(mosq, qos);
+		} else
+			return 1;
+		s.changed();
+		return 1;
+	}
+	for (pm = &s.members; *pm; pm = &(*pm)->next) {
+		cmp = strcmp((*pm)->id, id);
+		if (cmp >= 0)
+			break;
+	}
+	if (*pm && !cmp) {
+		if (len)
+			return 1;
+		/* member left */
+		m = *pm;
+		*pm = m->next;
+		syslog(LOG_NOTICE, "cluster member %s left", m->id);
+		free(m);
+	} else if (len) {
+		m = malloc(sizeof(*m) + strlen(id));
+		if (!m) {
+			syslog(LOG_ERR, "malloc cluster member failed");
+			exit(1);
+		}
+		strcpy(m->id, id);
+		m->hash = strhash(id, strlen(id));
+		m->next = *pm;
+		*pm = m;
+		syslog(LOG_NOTICE, "cluster member %s joined", m->id);
+	} else
+		return 1;
+	if (s.ready)
+		s.changed();
+	return 1;
+}
+
+/* rendezvous weight of an item for a member */
+static unsigned int weight(unsigned int hash, unsigned int mhash)
+{
+	hash ^= mhash;
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+int cluster_owns(unsigned int hash)
+{
+	struct member *m;
+	unsigned int w, mw;
+
+	if (!s.topic)
+		return 1;
+	if (!s.ready)
+		return 0;
+	w = weight(hash, s.hash);
+	for (m = s.members; m; m = m->next) {
+		mw = weight(hash, m->hash);
+		if (mw > w || (mw == w && strcmp(m->id, s.id) < 0))
+			return 0;
+	}
+	return 1;
+}
+
+int cluster_leader(void)
+{
+	if (!s.topic)
+		return 1;
+	return s.ready && (!s.members || strcmp(s.id, s.members->id) < 0);
+}
+
+int cluster_ready(void)
+{
+	return !s.topic || s.ready;
+}
@@ -0,0 +1,32 @@
+#ifndef _cluster_h_
+#define _cluster_h_
+
+struct mosquitto;
+
+/* cluster of instances that share one topic tree
+ * Each member holds a retained lease topic cluster/GROUP/ID,
+ * which its will message removes.
+ * Items are assigned to members by rendezvous hashing,
+ * the member with the lowest ID is the leader.
+ * Without cluster_init(), this instance owns everything.
+ */
+extern void cluster_init(const char *group, const char *id, void (*changed)(void));
+
+/* the lease topic, to set the will, and the pattern to subscribe */
+extern const char *cluster_topic(void);
+extern const char *cluster_pattern(void);
+
+/* publish or remove our lease */
+extern void cluster_join(struct mosquitto *mosq, int qos);
+extern void cluster_leave(struct mosquitto *mosq, int qos);
+
+/* process a lease message, returns 1 when it was one */
+extern int cluster_msg(struct mosquitto *mosq, const char *topic, const void *payload, int len, int qos);
+
+/* test ownership of an item, by the hash of its base topic */
+extern int cluster_owns(unsigned int hash);
+extern int cluster_leader(void);
+/* our lease is in place, ownership can be decided */
+extern int cluster_ready(void);
+
+#endif
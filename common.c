@@ -1,28 +1,50 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include "common.h"
 
-/* utils */
-int strtohhmm(char *str)
+/* utils
+ * The parsers work on (str, len) slices, like MQTT payloads,
+ * which need not be null-terminated and are never modified.
+ */
+static int strntoul(const char *str, int len, int *pused)
+{
+	int j, val = 0;
+
+	for (j = 0; j < len && str[j] >= '0' && str[j] <= '9'; ++j)
+		val = val*10 + str[j] - '0';
+	*pused = j;
+	return val;
+}
+
+int strntohhmm(const char *str, int len)
 {
-	char *next;
-	int hh, mm;
+	int used, hh, mm;
 
 	if (!str)
 		return -1;
-	hh = strtoul(str, &next, 10);
-	if (next <= str || !strchr(":hHuU", *next))
+	hh = strntoul(str, len, &used);
+	if (!used || used >= len || !strchr(":hHuU", str[used]))
 		return -1;
-	mm = strtoul(next+1, NULL, 10);
+	++used;
+	mm = strntoul(str+used, len-used, &used);
 	return hh*100+mm;
 }
 
-int strtowdays(char *str)
+int strntowdays(const char *str, int len)
 {
 	int j;
 	int result = 0;
 
-	for (j = 0; str[j] && (j < 7); ++j) {
+	for (j = 0; j < len && str[j] && (j < 7); ++j) {
 		if (!strchr("-_", str[j]))
 			/* enable this day,
 			 * wday is struct tm.tm_wday compatible
@@ -33,6 +55,102 @@ int strtowdays(char *str)
 	return result;
 }
 
+/* like strtod(), on a slice: it reads at most 63 bytes */
+double strntod(const char *str, int len, int *pused)
+{
+	char buf[64], *end;
+	double val;
+
+	if (len < 0)
+		len = 0;
+	if (len > sizeof(buf)-1)
+		len = sizeof(buf)-1;
+	memcpy(buf, str, len);
+	buf[len] = 0;
+	val = strtod(buf, &end);
+	*pused = end - buf;
+	return val;
+}
+
+static double parse_delay(const char *str, int len, int *pused, int icase)
+{
+	int j, unit;
+	double val;
+
+	val = strntod(str, len, &j);
+	unit = (j < len) ? str[j] : 0;
+	if (icase)
+		unit = tolower(unit);
+	switch (unit) {
+	case 'w':
+		val *= 7;
+	case 'd':
+		val *= 24;
+	case 'h':
+		val *= 60;
+	case 'm':
+		val *= 60;
+		++j;
+		break;
+	}
+	if (pused)
+		*pused = j;
+	return val;
+}
+
+double strntodelay(const char *str, int len, int *pused)
+{
+	return parse_delay(str, len, pused, 0);
+}
+
+double strncasetodelay(const char *str, int len, int *pused)
+{
+	return parse_delay(str, len, pused, 1);
+}
+
+/* FNV-1a string hash, used for topic lookup tables */
+unsigned int strhash(const char *str, int len)
+{
+	unsigned int hash = 2166136261U;
+
+	for (; len > 0; --len, ++str) {
+		hash ^= *(const unsigned char *)str;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static double (*wallclock_fn)(void);
+
+void set_wallclock(double (*fn)(void))
+{
+	wallclock_fn = fn;
+}
+
+/* current wall clock time, with sub-second precision */
+double wallclock(void)
+{
+	struct timespec t;
+
+	if (wallclock_fn)
+		return wallclock_fn();
+
+	clock_gettime(CLOCK_REALTIME, &t);
+	return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+double sock_idle(int fd)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	if (fd < 0 || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+		return -1;
+	if (info.tcpi_last_data_sent > info.tcpi_last_data_recv)
+		return info.tcpi_last_data_sent / 1e3;
+	return info.tcpi_last_data_recv / 1e3;
+}
+
 /* mktime, with DST crossing correction */
 time_t mktime_dstsafe(struct tm *tm)
 {
@@ -49,6 +167,222 @@ time_t mktime_dstsafe(struct tm *tm)
 	return result;
 }
 
+/* calendar cache
+ * localtime() & mktime() are expensive (locking, tz file checks),
+ * so keep today's local date & the next DST transition,
+ * and compute alarm times with plain arithmetic.
+ * Local midnight need not exist (DST may start at 00:00),
+ * so the day is kept in local seconds, not as an instant.
+ */
+#define CAL_HORIZON	(9*86400)
+/* let mktime decide within this distance of a transition */
+#define CAL_NEAR	86400
+
+static struct {
+	int valid;
+	/* >1 transition within the horizon, fallback to mktime */
+	int complex;
+	int wday;
+	/* today's 00:00, in local seconds since epoch */
+	time_t day;
+	/* the cache holds for [begin, end) */
+	time_t begin, end;
+	long gmtoff;
+	/* transition earlier today, 0 when none */
+	time_t since;
+	/* next transition, 0 when none within horizon */
+	time_t dst;
+	long dstoff;
+} cal;
+
+static long cal_gmtoff(time_t t)
+{
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	return tm.tm_gmtoff;
+}
+
+/* the first instant after @lo with another offset, for 1 transition up to @hi */
+static time_t cal_transition(time_t lo, time_t hi)
+{
+	long off = cal_gmtoff(lo);
+	time_t mid;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo)/2;
+		if (cal_gmtoff(mid) == off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return hi;
+}
+
+static void cal_refresh(time_t tnow)
+{
+	struct tm tm;
+	time_t end;
+
+	/* pick up timezone changes */
+	tzset();
+	localtime_r(&tnow, &tm);
+	cal.wday = tm.tm_wday;
+	cal.gmtoff = tm.tm_gmtoff;
+	cal.day = tnow + cal.gmtoff - (tm.tm_hour*3600 + tm.tm_min*60 + tm.tm_sec);
+
+	/* today began at local 00:00, or at a transition after that */
+	cal.begin = cal.day - cal.gmtoff;
+	cal.since = 0;
+	if (cal.begin < tnow && cal_gmtoff(cal.begin) != cal.gmtoff)
+		cal.begin = cal.since = cal_transition(cal.begin, tnow);
+	cal.end = cal.day + 86400 - cal.gmtoff;
+
+	/* find the next transition */
+	cal.dst = 0;
+	cal.complex = 0;
+	end = tnow + CAL_HORIZON;
+	if (cal_gmtoff(end) != cal.gmtoff) {
+		cal.dst = cal_transition(tnow, end);
+		cal.dstoff = cal_gmtoff(cal.dst);
+		cal.complex = cal_gmtoff(end) != cal.dstoff;
+		/* local midnight moves with the offset */
+		if (cal.dst < cal.end)
+			cal.end = cal.dst;
+	}
+	cal.valid = 1;
+}
+
+static inline int cal_near(time_t t, time_t transition)
+{
+	return transition && t > transition - CAL_NEAR && t < transition + CAL_NEAR;
+}
+
+void cal_reset(void)
+{
+	cal.valid = 0;
+}
+
+static time_t cal_next_hhmm_mktime(int hhmm, int wdays, time_t tnow)
+{
+	struct tm tm;
+	time_t tnext;
+	int j;
+
+	localtime_r(&tnow, &tm);
+	tm.tm_hour = hhmm / 100;
+	tm.tm_min = hhmm % 100;
+	tm.tm_sec = 0;
+	tnext = mktime_dstsafe(&tm);
+	if (tnext <= (tnow + 1)) {
+		tm.tm_mday += 1;
+		tnext = mktime_dstsafe(&tm);
+	}
+	if (wdays)
+	for (j = 0; j < 7; ++j) {
+		if (wdays & (1 << tm.tm_wday))
+			break;
+		tm.tm_mday += 1;
+		tnext = mktime_dstsafe(&tm);
+	}
+	return tnext;
+}
+
+time_t cal_next_hhmm(int hhmm, int wdays, time_t tnow)
+{
+	time_t tnext = 0, local;
+	int j;
+
+	if (!cal.valid || tnow < cal.begin || tnow >= cal.end)
+		cal_refresh(tnow);
+	if (cal.complex)
+		return cal_next_hhmm_mktime(hhmm, wdays, tnow);
+
+	for (j = 0; j < 8; ++j) {
+		local = cal.day + j*86400L + (hhmm / 100)*3600 + (hhmm % 100)*60;
+		tnext = local - cal.gmtoff;
+		if (cal_near(tnext, cal.since) || cal_near(tnext, cal.dst) ||
+				cal_near(local - cal.dstoff, cal.dst))
+			/* gaps & repeated hours resolve like mktime_dstsafe() */
+			return cal_next_hhmm_mktime(hhmm, wdays, tnow);
+		if (cal.dst && tnext >= cal.dst)
+			/* local time after DST transition */
+			tnext = local - cal.dstoff;
+		if (tnext <= (tnow + 1))
+			continue;
+		if (!wdays || (wdays & (1 << ((cal.wday + j) % 7))))
+			break;
+	}
+	return tnext;
+}
+
+/* state snapshots
+ * The file is replaced atomically: a new file is written next to it,
+ * and renamed over the old one.
+ */
+int snapshot_save(const char *file, const void *dat, size_t len)
+{
+	char *tmp;
+	int fd, ret, saved_errno;
+	size_t done;
+
+	if (asprintf(&tmp, "%s.tmp", file) < 0)
+		return -1;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto fail;
+	for (done = 0; done < len; done += ret) {
+		ret = write(fd, (const char *)dat + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;
+		else if (ret < 0)
+			goto fail_fd;
+	}
+	if (fdatasync(fd) < 0)
+		goto fail_fd;
+	if (close(fd) < 0)
+		goto fail;
+	if (rename(tmp, file) < 0)
+		goto fail;
+	free(tmp);
+	return 0;
+
+fail_fd:
+	close(fd);
+fail:
+	saved_errno = errno;
+	unlink(tmp);
+	free(tmp);
+	errno = saved_errno;
+	return -1;
+}
+
+const void *snapshot_map(const char *file, size_t *plen)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || !st.st_size) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	*plen = st.st_size;
+	return map;
+}
+
+void snapshot_unmap(const void *map, size_t len)
+{
+	munmap((void *)map, len);
+}
+
 /* csprintf: like asprintf, but return a semi-static buffer,
  * so no need to free things
  */
@@ -5,9 +5,33 @@
 #ifndef _common_h_
 #define _common_h_
 
-extern int strtohhmm(char *str);
-extern int strtowdays(char *str);
+/* length-aware parsers, for MQTT payloads */
+extern int strntohhmm(const char *str, int len);
+extern int strntowdays(const char *str, int len);
+extern double strntodelay(const char *str, int len, int *pused);
+/* the same, with case-insensitive units, for timer specs */
+extern double strncasetodelay(const char *str, int len, int *pused);
+extern double strntod(const char *str, int len, int *pused);
+extern unsigned int strhash(const char *str, int len);
 extern time_t mktime_dstsafe(struct tm *tm);
+extern double wallclock(void);
+/* let wallclock() follow another clock, i.e. a simulated one */
+extern void set_wallclock(double (*fn)(void));
+/* seconds since TCP socket @fd sent resp. received data,
+ * whichever is longer ago, -1 when unknown
+ */
+extern double sock_idle(int fd);
+
+/* next occurence of local time @hhmm on any of @wdays (0 for all days)
+ * cal_reset() drops the cached calendar, i.e. after a time change
+ */
+extern time_t cal_next_hhmm(int hhmm, int wdays, time_t tnow);
+extern void cal_reset(void);
+
+/* state snapshot files */
+extern int snapshot_save(const char *file, const void *dat, size_t len);
+extern const void *snapshot_map(const char *file, size_t *plen);
+extern void snapshot_unmap(const void *map, size_t len);
 
 __attribute__((format(printf,1,2)))
 extern const char *csprintf(const char *fmt, ...);
@@ -16,7 +16,7 @@
  * You should have received a copy of the GNU Lesser Public License
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -24,64 +24,137 @@
 
 #include "libt.h"
 
+/*
+ * Timeouts are kept in a hierarchical timer wheel.
+ * The wheel has WHEEL_LEVELS levels of WHEEL_SIZE slots,
+ * a slot at level L spans WHEEL_SIZE^L ticks.
+ * A timeout goes to the lowest level where it shares the upper bits
+ * with the current tick, and moves down (cascades) once the current
+ * tick enters its slot. A bitmap per level tells which slots are used,
+ * so idle periods are skipped at once.
+ * A hash table on (fn, dat) finds the timeout for the API calls,
+ * so adding and removing do not depend on the number of timeouts.
+ */
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE-1)
+#define WHEEL_LEVELS	6
+/* ticks covered by the wheel, later timeouts wait in a separate list */
+#define WHEEL_SPAN	((uint64_t)1 << (WHEEL_BITS*WHEEL_LEVELS))
+#define TICK		0.001
+
 struct timer {
-	struct timer *next, *prev;
+	struct timer *next, **pprev;
+	/* hash table collision chain */
+	struct timer *hnext;
 	void (*fn)(void *dat);
 	void *dat;
 	double wakeup;
+	uint64_t tick;
+	/* position in the wheel
+	 * @level is WHEEL_LEVELS for the far list, -1 outside the wheel
+	 */
+	int level, slot;
 };
 
 static struct {
-	struct timer *timers;
+	struct timer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+	uint64_t used[WHEEL_LEVELS];
+	/* beyond WHEEL_SPAN */
+	struct timer *far;
+	/* current tick, earlier ticks are processed */
+	uint64_t now;
+	int started;
+	/* libt_set_clock() */
+	double (*clock)(void);
+	/* libt_set_early() */
+	double early;
+	/* index on (fn, dat) */
+	struct timer **htab;
+	int htabsize;
+	int nhash;
 	struct timer *tmptimers;
-} s;
+} s = {
+	/* poll() sleeps with msec resolution */
+	.early = TICK,
+};
 
-/* double-linked-list black magic:
- * The @prev member of the first element points to a 'fake' element
- * which is well-crafted so that assigning prev->next just happens
- * to set the root pointer
- * This function return the required 'fake' pointers
+/* double linked list
+ * @pprev points to the pointer that points to us, the list root
+ * for the first element. That is alias-safe, unlike a 'fake' element.
  */
-static inline struct timer *t_fakeelement(struct timer **root)
-{
-	return (struct timer *)(((char *)root) - offsetof(struct timer, next));
-
-}
-
-/* double linked list */
 static void t_del(struct timer *t)
 {
-	if (t->next)
-		t->next->prev = t->prev;
-	if (t->prev)
-		t->prev->next = t->next;
-	t->next = t->prev = NULL;
+	if (t->pprev) {
+		*t->pprev = t->next;
+		if (t->next)
+			t->next->pprev = t->pprev;
+	}
+	t->next = NULL;
+	t->pprev = NULL;
 }
 
 static void t_add(struct timer *t, struct timer **root)
 {
 	t_del(t);
 	t->next = *root;
-	if (t->next) {
-		t->prev = t->next->prev;
-		t->next->prev = t;
-	} else
-		/* this is dirty: fake a timer struct, which will only be used
-		 * for setting the @next member
-		 */
-		t->prev = t_fakeelement(root);
-	t->prev->next = t;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = root;
+	*root = t;
 }
 
-static void t_add_sorted(struct timer *t, struct timer **root)
+/* hash table */
+static inline unsigned int t_hash(void (*fn)(void *), const void *dat)
 {
-	t_del(t);
-	/* iterate root until all smaller items have passed */
-	for (; *root; root = &(*root)->next) {
-		if (t->wakeup < (*root)->wakeup)
+	uint64_t h = ((uintptr_t)fn * 0x9e3779b97f4a7c15ULL) ^ ((uintptr_t)dat * 0xc2b2ae3d27d4eb4fULL);
+
+	return h ^ (h >> 32);
+}
+
+static void t_hash_grow(void)
+{
+	struct timer **newtab, *t, *next;
+	int newsize = s.htabsize ? s.htabsize*2 : 64;
+	int j;
+	unsigned int idx;
+
+	newtab = calloc(newsize, sizeof(*newtab));
+	for (j = 0; j < s.htabsize; ++j) {
+		for (t = s.htab[j]; t; t = next) {
+			next = t->hnext;
+			idx = t_hash(t->fn, t->dat) & (newsize-1);
+			t->hnext = newtab[idx];
+			newtab[idx] = t;
+		}
+	}
+	free(s.htab);
+	s.htab = newtab;
+	s.htabsize = newsize;
+}
+
+static void t_hash_add(struct timer *t)
+{
+	unsigned int idx;
+
+	if (++s.nhash > s.htabsize)
+		t_hash_grow();
+	idx = t_hash(t->fn, t->dat) & (s.htabsize-1);
+	t->hnext = s.htab[idx];
+	s.htab[idx] = t;
+}
+
+static void t_hash_del(struct timer *t)
+{
+	struct timer **pt;
+
+	for (pt = &s.htab[t_hash(t->fn, t->dat) & (s.htabsize-1)]; *pt; pt = &(*pt)->hnext) {
+		if (*pt == t) {
+			*pt = t->hnext;
+			--s.nhash;
 			break;
+		}
 	}
-	t_add(t, root);
 }
 
 /* local/private tools */
@@ -89,20 +162,146 @@ static struct timer *t_find(void (*fn)(void *), const void *dat)
 {
 	struct timer *t;
 
-	for (t = s.timers; t; t = t->next) {
-		if ((t->fn == fn) && (t->dat == dat))
-			return t;
-	}
-	for (t = s.tmptimers; t; t = t->next) {
+	if (!s.htabsize)
+		return NULL;
+	for (t = s.htab[t_hash(fn, dat) & (s.htabsize-1)]; t; t = t->hnext) {
 		if ((t->fn == fn) && (t->dat == dat))
 			return t;
 	}
 	return NULL;
 }
 
+static inline uint64_t t_tick(double wakeup)
+{
+	double tick = wakeup / TICK;
+
+	/* truncation rounds down, for positive values */
+	if (tick < 0)
+		return 0;
+	/* far enough for any use, and no overflow */
+	if (tick > 0x1p62)
+		return (uint64_t)1 << 62;
+	return tick;
+}
+
+/* wheel */
+static void w_unlink(struct timer *t)
+{
+	t_del(t);
+	if (t->level >= 0 && t->level < WHEEL_LEVELS && !s.wheel[t->level][t->slot])
+		s.used[t->level] &= ~((uint64_t)1 << t->slot);
+	t->level = -1;
+}
+
+static void w_place(struct timer *t)
+{
+	uint64_t tick = t->tick;
+	int level;
+
+	if (tick < s.now)
+		/* due already */
+		tick = s.now;
+	if ((tick ^ s.now) >= WHEEL_SPAN) {
+		t->level = WHEEL_LEVELS;
+		t_add(t, &s.far);
+		return;
+	}
+	for (level = 0; level < WHEEL_LEVELS-1; ++level) {
+		if (!((tick ^ s.now) >> (WHEEL_BITS*(level+1))))
+			break;
+	}
+	t->level = level;
+	t->slot = (tick >> (WHEEL_BITS*level)) & WHEEL_MASK;
+	t_add(t, &s.wheel[level][t->slot]);
+	s.used[level] |= (uint64_t)1 << t->slot;
+}
+
+/* find the first tick where something is to be done,
+ * i.e. the start of the first used slot
+ * Returns its level, or -1 when nothing is scheduled
+ */
+static int w_next(uint64_t *ptick, int skipcur)
+{
+	uint64_t bits;
+	int level, idx;
+
+	/* level 0, this tick included unless @skipcur */
+	idx = s.now & WHEEL_MASK;
+	bits = s.used[0] & ~((((uint64_t)1 << skipcur) << idx) - 1);
+	if (bits) {
+		*ptick = (s.now & ~(uint64_t)WHEEL_MASK) + __builtin_ctzll(bits);
+		return 0;
+	}
+	/* higher levels only hold slots after the current one */
+	for (level = 1; level < WHEEL_LEVELS; ++level) {
+		idx = (s.now >> (WHEEL_BITS*level)) & WHEEL_MASK;
+		bits = s.used[level] & ~((((uint64_t)2) << idx) - 1);
+		if (bits) {
+			*ptick = (s.now & ~(((uint64_t)1 << (WHEEL_BITS*(level+1))) - 1)) +
+				((uint64_t)__builtin_ctzll(bits) << (WHEEL_BITS*level));
+			return level;
+		}
+	}
+	if (s.far) {
+		*ptick = (s.now | (WHEEL_SPAN-1)) + 1;
+		return WHEEL_LEVELS;
+	}
+	return -1;
+}
+
+/* move the current tick forward, and cascade what it reached */
+static void w_advance(uint64_t tick)
+{
+	uint64_t old = s.now;
+	struct timer *t;
+	int level, slot;
+
+	s.now = tick;
+	if ((old ^ tick) >= WHEEL_SPAN) {
+		/* a new span, the far timeouts may fit in */
+		while ((t = s.far) != NULL) {
+			w_unlink(t);
+			w_place(t);
+		}
+	}
+	for (level = WHEEL_LEVELS-1; level > 0; --level) {
+		if (!((old ^ tick) >> (WHEEL_BITS*level)))
+			continue;
+		slot = (tick >> (WHEEL_BITS*level)) & WHEEL_MASK;
+		while ((t = s.wheel[level][slot]) != NULL) {
+			w_unlink(t);
+			w_place(t);
+		}
+	}
+}
+
+static void t_schedule(struct timer *t, double wakeuptime)
+{
+	if (!s.started) {
+		s.now = t_tick(libt_now());
+		s.started = 1;
+	}
+	w_unlink(t);
+	t->wakeup = wakeuptime;
+	t->tick = t_tick(wakeuptime);
+	w_place(t);
+}
+
 /* exported API */
+void libt_set_clock(double (*now)(void))
+{
+	s.clock = now;
+}
+
+void libt_set_early(double early)
+{
+	s.early = early;
+}
+
 double libt_now(void)
 {
+	if (s.clock)
+		return s.clock();
 #if defined(USE_GETTIMEOFDAY)
 	struct timeval t;
 	if (0 != gettimeofday(&t, 0))
@@ -139,9 +338,10 @@ void libt_add_timeouta(double wakeuptime, void (*fn)(void *), const void *dat)
 		memset(t, 0, sizeof(*t));
 		t->fn = fn;
 		t->dat = (void *)dat;
+		t->level = -1;
+		t_hash_add(t);
 	}
-	t->wakeup = wakeuptime;
-	t_add_sorted(t, &s.timers);
+	t_schedule(t, wakeuptime);
 }
 
 void libt_repeat_timeout(double increment, void (*fn)(void *), const void *dat)
@@ -155,16 +355,16 @@ void libt_repeat_timeout(double increment, void (*fn)(void *), const void *dat)
 		libt_add_timeout(increment, fn, dat);
 	else {
 		double now = libt_now();
+		double wakeup = t->wakeup + increment;
 
-		t->wakeup += increment;
-		if (t->wakeup < now)
+		if (wakeup < now)
 			/* We're scheduling in the past.
 			 * Jump to the future again,
 			 * make 'repeat' fail in maintaining strict timing
 			 * and mimic 'add' behaviour
 			 */
-			t->wakeup = now + increment;
-		t_add_sorted(t, &s.timers);
+			wakeup = now + increment;
+		t_schedule(t, wakeup);
 	}
 }
 
@@ -174,7 +374,8 @@ void libt_remove_timeout(void (*fn)(void *), const void *dat)
 
 	t = t_find(fn, dat);
 	if (t) {
-		t_del(t);
+		w_unlink(t);
+		t_hash_del(t);
 		free(t);
 	}
 }
@@ -186,28 +387,53 @@ int libt_timeout_exist(void (*fn)(void *), const void *dat)
 
 int libt_flush(void)
 {
-	struct timer *t;
+	struct timer *t, *slot;
 	double now;
-	int cnt;
+	uint64_t target, tick;
+	int cnt, level;
 
-	now = libt_now() +0.001;
+	now = libt_now() + s.early;
+	target = t_tick(now);
 	cnt = 0;
-	while (s.timers) {
-		t = s.timers;
-		if (t->wakeup > now)
-			break;
-		/*
-		 * move tries to garbage, for possible re-arm inside
-		 * the timer callback
+	if (!s.started || target < s.now)
+		target = s.now;
+	while (1) {
+		/* detach the slot of this tick,
+		 * callbacks may add to it again for the next flush
 		 */
-		t_add(t, &s.tmptimers);
-		t->fn(t->dat);
-		++cnt;
+		slot = NULL;
+		while ((t = s.wheel[0][s.now & WHEEL_MASK]) != NULL) {
+			w_unlink(t);
+			t_add(t, &slot);
+		}
+		while ((t = slot) != NULL) {
+			if (t->wakeup > now && s.now >= target) {
+				/* later within this tick */
+				t_del(t);
+				w_place(t);
+				continue;
+			}
+			/*
+			 * move tries to garbage, for possible re-arm inside
+			 * the timer callback
+			 */
+			t_add(t, &s.tmptimers);
+			t->fn(t->dat);
+			++cnt;
+		}
+		if (s.now >= target)
+			break;
+		if (s.wheel[0][s.now & WHEEL_MASK])
+			/* added by the callbacks, and due too */
+			continue;
+		level = w_next(&tick, 1);
+		w_advance((level < 0 || tick > target) ? target : tick);
 	}
 	/* clean up cache */
 	while (s.tmptimers) {
 		t = s.tmptimers;
 		t_del(t);
+		t_hash_del(t);
 		free(t);
 	}
 	return cnt;
@@ -215,14 +441,33 @@ int libt_flush(void)
 
 double libt_next_wakeup(void)
 {
-	return s.timers ? s.timers->wakeup : -1;
+	struct timer *t;
+	uint64_t tick;
+	double wakeup;
+
+	switch (w_next(&tick, 0)) {
+	case -1:
+		return -1;
+	case 0:
+		/* exact, within the slot */
+		t = s.wheel[0][tick & WHEEL_MASK];
+		for (wakeup = t->wakeup; t; t = t->next) {
+			if (t->wakeup < wakeup)
+				wakeup = t->wakeup;
+		}
+		return wakeup;
+	default:
+		/* a slot to cascade, libt_flush() runs nothing then */
+		return tick * TICK;
+	}
 }
 
 int libt_get_waittime(void)
 {
 	double tmp;
 
-	if (!s.timers)
+	tmp = libt_next_wakeup();
+	if (tmp < 0)
 		return -1;
 	/* avoid integer overflows and use double
 	 * An integer overflow may result into a negative
@@ -231,7 +476,7 @@ int libt_get_waittime(void)
 	 * libt_get_waittime() for poll() runs away with the cpu
 	 * because the waittime is wrong.
 	 */
-	tmp = (s.timers->wakeup - libt_now()) * 1000;
+	tmp = (tmp - libt_now()) * 1000;
 	/* compute the max result value that we want to return.
 	 * This is 1/4 of the maximum int value
 	 */
@@ -249,15 +494,15 @@ __attribute__((destructor))
 void libt_cleanup(void)
 {
 	struct timer *t;
+	int j;
 
-	while (s.timers) {
-		t = s.timers;
-		s.timers = t->next;
-		free(t);
-	}
-	while (s.tmptimers) {
-		t = s.tmptimers;
-		s.tmptimers = t->next;
-		free(t);
+	for (j = 0; j < s.htabsize; ++j) {
+		while (s.htab[j]) {
+			t = s.htab[j];
+			s.htab[j] = t->hnext;
+			free(t);
+		}
 	}
+	free(s.htab);
+	memset(&s, 0, sizeof(s));
 }
@@ -25,6 +25,17 @@ extern "C" {
 /* libt's notion of now() */
 extern double libt_now(void);
 
+/* use another clock for libt_now(), i.e. a simulated clock
+ * Call this before scheduling any timeout. NULL restores CLOCK_MONOTONIC.
+ */
+extern void libt_set_clock(double (*now)(void));
+
+/* libt_flush() runs the timeouts that are due within @early seconds too,
+ * default 1msec, the resolution of poll().
+ * An exact timer needs no margin, since it does not wake up early.
+ */
+extern void libt_set_early(double early);
+
 /* schedule a timeout @wakeuptime */
 extern void libt_add_timeouta(double wakeuptime, void (*fn)(void *), const void *dat);
 
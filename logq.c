@@ -0,0 +1,179 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "common.h"
+#include "logq.h"
+#include "metrics.h"
+
+METRIC(m_logdrops, "log.drops");
+METRIC(m_logsuppressed, "log.suppressed");
+
+/* power of 2 */
+#define LOGQ_SIZE	512
+#define LOGQ_LINE	256
+/* formats to rate limit per window, power of 2 */
+#define LOGQ_NRATE	128
+
+struct logent {
+	int ready;
+	int level;
+	char msg[LOGQ_LINE];
+};
+
+struct lograte {
+	/* the format, NULL for a free slot */
+	const char *fmt;
+	int level;
+	/* logged & counted in this window */
+	unsigned int n;
+	unsigned int suppressed;
+	/* the last suppressed message */
+	char msg[LOGQ_LINE];
+};
+
+static struct {
+	struct logent ring[LOGQ_SIZE];
+	/* free running, head is claimed by the producers */
+	unsigned int head, tail;
+	unsigned int drops;
+	struct lograte rate[LOGQ_NRATE];
+	/* start of the rate window, CLOCK_MONOTONIC */
+	double window;
+	/* totals, for the metrics */
+	unsigned long ndrops, nsuppressed;
+} s;
+
+static double logq_now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+/* find or claim the slot of format @fmt, NULL when the table is full
+ * The formats are string literals, so the pointer identifies them.
+ */
+static struct lograte *logq_rate(const char *fmt, int level)
+{
+	struct lograte *r;
+	const char *old;
+	unsigned int j, idx;
+
+	idx = ((unsigned long)fmt >> 3) * 0x9e3779b1U;
+	for (j = 0; j < LOGQ_NRATE; ++j, ++idx) {
+		r = &s.rate[idx % LOGQ_NRATE];
+		old = __atomic_load_n(&r->fmt, __ATOMIC_ACQUIRE);
+		if (!old) {
+			if (__atomic_compare_exchange_n(&r->fmt, &old, fmt, 0,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				r->level = level;
+				__atomic_store_n(&r->n, 0, __ATOMIC_RELEASE);
+				return r;
+			}
+			/* claimed meanwhile */
+		}
+		if (old == fmt)
+			return r;
+	}
+	return NULL;
+}
+
+/* after the atexit() handlers, which may log too */
+__attribute__((destructor))
+static void logq_exit(void)
+{
+	/* end the rate window, to summarise it too */
+	s.window -= 1;
+	logq_flush();
+}
+
+void logq_add(int level, const char *fmt, ...)
+{
+	struct lograte *r;
+	struct logent *e;
+	unsigned int h;
+	char msg[LOGQ_LINE];
+	va_list va;
+
+	if (!(setlogmask(0) & LOG_MASK(LOG_PRI(level))))
+		return;
+	va_start(va, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, va);
+	va_end(va);
+
+	r = logq_rate(fmt, level);
+	if (r && __atomic_add_fetch(&r->n, 1, __ATOMIC_RELAXED) > LOGQ_BURST) {
+		/* keep the last one, for the summary */
+		strcpy(r->msg, msg);
+		__atomic_add_fetch(&r->suppressed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	/* claim a slot */
+	h = __atomic_load_n(&s.head, __ATOMIC_RELAXED);
+	do {
+		if (h - __atomic_load_n(&s.tail, __ATOMIC_ACQUIRE) >= LOGQ_SIZE) {
+			/* the sink is behind */
+			__atomic_add_fetch(&s.drops, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&s.head, &h, h+1, 1,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	e = &s.ring[h % LOGQ_SIZE];
+	e->level = level;
+	strcpy(e->msg, msg);
+	__atomic_store_n(&e->ready, 1, __ATOMIC_RELEASE);
+}
+
+int logq_flush(void)
+{
+	struct logent *e;
+	struct lograte *r;
+	unsigned int t, head, n;
+	double now;
+	int cnt = 0, j;
+
+	head = __atomic_load_n(&s.head, __ATOMIC_ACQUIRE);
+	for (t = s.tail; t != head; ++t) {
+		e = &s.ring[t % LOGQ_SIZE];
+		if (!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE))
+			/* still being formatted */
+			break;
+		syslog(e->level, "%s", e->msg);
+		++cnt;
+		e->ready = 0;
+		__atomic_store_n(&s.tail, t+1, __ATOMIC_RELEASE);
+	}
+
+	n = __atomic_exchange_n(&s.drops, 0, __ATOMIC_RELAXED);
+	if (n) {
+		syslog(LOG_WARNING, "dropped %u log messages", n);
+		s.ndrops += n;
+		metric_set(&m_logdrops, s.ndrops);
+	}
+
+	now = logq_now();
+	if (now - s.window < 1)
+		return cnt;
+	/* a new rate window, summarise the previous, and start empty */
+	s.window = now;
+	for (j = 0; j < LOGQ_NRATE; ++j) {
+		r = &s.rate[j];
+		if (!__atomic_load_n(&r->fmt, __ATOMIC_ACQUIRE))
+			continue;
+		n = __atomic_exchange_n(&r->suppressed, 0, __ATOMIC_RELAXED);
+		if (n) {
+			syslog(r->level, "%s (and %u more like it)", r->msg, n);
+			s.nsuppressed += n;
+			metric_set(&m_logsuppressed, s.nsuppressed);
+		}
+		__atomic_store_n(&r->fmt, NULL, __ATOMIC_RELEASE);
+	}
+	return cnt;
+}
@@ -0,0 +1,23 @@
+#ifndef _logq_h_
+#define _logq_h_
+
+/* a log queue, so that logging does not block the event loop
+ * logq_add() formats into a ring buffer, without locks.
+ * Levels that setlogmask() filters out are not even formatted.
+ * logq_flush() hands them to syslog().
+ * A full ring drops messages instead of waiting.
+ * A format that repeats more than LOGQ_BURST times within a second
+ * is counted instead, and summarised in 1 line with its last message.
+ */
+#define LOGQ_BURST	10
+
+__attribute__((format(printf,2,3)))
+extern void logq_add(int level, const char *fmt, ...);
+
+/* write the queued messages, from the idle part of the main loop
+ * This runs at exit too.
+ * returns the number of messages written
+ */
+extern int logq_flush(void);
+
+#endif
@@ -0,0 +1,124 @@
+#ifdef WITH_METRICS
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "lib/libt.h"
+#include "metrics.h"
+#include "pubq.h"
+
+/* publish interval */
+#define METRICS_INTERVAL	60.0
+
+static struct {
+	struct metric *list, **last;
+	char *topic;
+	volatile int dump;
+} s;
+
+void metric_register(struct metric *m)
+{
+	if (!s.last)
+		s.last = &s.list;
+	*s.last = m;
+	s.last = &m->next;
+	m->registered = 1;
+}
+
+void metric_lag_add(struct metric *m, double lag)
+{
+	int j;
+	double ms;
+
+	m->islag = 1;
+	++m->count;
+	if (lag < 0)
+		lag = 0;
+	m->sum += lag;
+	if (lag > m->max)
+		m->max = lag;
+	for (j = 0, ms = 1; j < METRIC_NBUCKETS-1 && lag*1e3 >= ms; ++j, ms *= 2);
+	++m->hist[j];
+}
+
+/* format 1 metric as JSON member */
+static int metric_format(char *buf, int size, const struct metric *m)
+{
+	int len, j;
+
+	if (!m->islag)
+		return snprintf(buf, size, "\"%s\":%lu", m->name, m->count);
+	len = snprintf(buf, size, "\"%s\":{\"n\":%lu,\"avg\":%.6f,\"max\":%.6f,\"hist\":[",
+			m->name, m->count, m->count ? m->sum / m->count : 0, m->max);
+	for (j = 0; j < METRIC_NBUCKETS; ++j)
+		len += snprintf(buf+len, (len < size) ? size-len : 0, "%s%lu", j ? "," : "", m->hist[j]);
+	len += snprintf(buf+len, (len < size) ? size-len : 0, "]}");
+	return len;
+}
+
+static void metrics_publish(void *dat)
+{
+	static char *buf;
+	static int size;
+	struct metric *m;
+	int len;
+
+	if (!buf) {
+		size = 1024;
+		buf = malloc(size);
+	}
+	for (;;) {
+		len = snprintf(buf, size, "{");
+		for (m = s.list; m; m = m->next) {
+			if (m != s.list)
+				len += snprintf(buf+len, (len < size) ? size-len : 0, ",");
+			len += metric_format(buf+len, (len < size) ? size-len : 0, m);
+		}
+		len += snprintf(buf+len, (len < size) ? size-len : 0, "}");
+		if (len < size)
+			break;
+		size = len+1;
+		buf = realloc(buf, size);
+		if (!buf) {
+			syslog(LOG_ERR, "realloc metrics: %s", strerror(errno));
+			exit(1);
+		}
+	}
+	/* on the default queue, i.e. the first broker */
+	pubq_select(NULL);
+	pubq_add(s.topic, buf, len, 1);
+	libt_add_timeout(METRICS_INTERVAL, metrics_publish, NULL);
+}
+
+static void onsigusr1(int sig)
+{
+	s.dump = 1;
+}
+
+void metrics_init(const char *name)
+{
+	if (asprintf(&s.topic, "state/%s/metrics", name) < 0) {
+		syslog(LOG_ERR, "asprintf metrics topic failed");
+		exit(1);
+	}
+	signal(SIGUSR1, onsigusr1);
+	libt_add_timeout(METRICS_INTERVAL, metrics_publish, NULL);
+}
+
+void metrics_poll(void)
+{
+	struct metric *m;
+	char buf[512];
+
+	if (!s.dump)
+		return;
+	s.dump = 0;
+	for (m = s.list; m; m = m->next) {
+		metric_format(buf, sizeof(buf), m);
+		syslog(LOG_NOTICE, "metric %s", buf);
+	}
+}
+#endif
@@ -0,0 +1,74 @@
+#ifndef _metrics_h_
+#define _metrics_h_
+
+/* run-time counters & latency histograms
+ * Enable with 'CPPFLAGS += -DWITH_METRICS' in config.mk.
+ * Without it, all of this compiles to nothing.
+ */
+#ifdef WITH_METRICS
+
+/* lag histogram buckets, in powers of 2 milliseconds */
+#define METRIC_NBUCKETS	16
+
+struct metric {
+	const char *name;
+	struct metric *next;
+	int registered;
+	unsigned long count;
+	/* lag metrics */
+	int islag;
+	double sum, max;
+	unsigned long hist[METRIC_NBUCKETS];
+};
+
+#define METRIC(var, str)	static struct metric var = { .name = (str), }
+
+extern void metric_register(struct metric *m);
+extern void metric_lag_add(struct metric *m, double lag);
+
+static inline void metric_inc(struct metric *m)
+{
+	if (!m->registered)
+		metric_register(m);
+	++m->count;
+}
+
+static inline void metric_add(struct metric *m, unsigned long n)
+{
+	if (!m->registered)
+		metric_register(m);
+	m->count += n;
+}
+
+/* gauges hold a value instead of a count */
+static inline void metric_set(struct metric *m, unsigned long value)
+{
+	if (!m->registered)
+		metric_register(m);
+	m->count = value;
+}
+
+/* a lag of @lag seconds */
+static inline void metric_lag(struct metric *m, double lag)
+{
+	if (!m->registered)
+		metric_register(m);
+	metric_lag_add(m, lag);
+}
+
+/* publish on state/@name/metrics periodically, and dump on SIGUSR1 */
+extern void metrics_init(const char *name);
+/* call from the main loop */
+extern void metrics_poll(void);
+
+#else
+#define METRIC(var, str)
+#define metric_inc(m)		do {} while (0)
+#define metric_add(m, n)	do {} while (0)
+#define metric_set(m, value)	do {} while (0)
+#define metric_lag(m, lag)	do {} while (0)
+#define metrics_init(name)	do {} while (0)
+#define metrics_poll()		do {} while (0)
+#endif
+
+#endif
@@ -12,29 +12,38 @@
 
 #include <unistd.h>
 #include <getopt.h>
-#include <poll.h>
 #include <syslog.h>
-#include <sys/timerfd.h>
+#include <sys/epoll.h>
 #include <mosquitto.h>
+#include <mqtt_protocol.h>
 
 #include "lib/libt.h"
 #include "common.h"
-
-#ifndef TFD_TIMER_CANCEL_ON_SET
-#define TFD_TIMER_CANCEL_ON_SET (1 << 1)
-#endif
+#include "pubq.h"
+#include "cluster.h"
+#include "metrics.h"
+#include "alloc.h"
+#include "rpnlogic.h"
+#include "replay.h"
+#include "tsource.h"
+#include "logq.h"
 
 #define NAME "mqttalrm"
 #ifndef VERSION
 #define VERSION "<undefined version>"
 #endif
 
-/* generic error logging */
+/* generic error logging, via the log queue
+ * Errors are written right away, after what is queued.
+ */
 #define mylog(loglevel, fmt, ...) \
 	({\
-		syslog(loglevel, fmt, ##__VA_ARGS__); \
-		if (loglevel <= LOG_ERR)\
+		if (loglevel <= LOG_ERR) {\
+			logq_flush();\
+			syslog(loglevel, fmt, ##__VA_ARGS__); \
 			exit(1);\
+		}\
+		logq_add(loglevel, fmt, ##__VA_ARGS__); \
 	})
 #define ESTR(num)	strerror(num)
 
@@ -46,10 +55,28 @@ static const char help_msg[] =
 	"Options\n"
 	" -V, --version		Show version\n"
 	" -v, --verbose		Be more verbose\n"
-	" -m, --mqtt=HOST[:PORT]Specify alternate MQTT host+port\n"
+	" -m, --mqtt=HOST[:PORT]Specify alternate MQTT host+port, repeat for several brokers,\n"
+	"			each with its own alarms\n"
+	" -i, --id=NAME		MQTT client id for the persistent session (default " NAME "-HOSTNAME)\n"
+	" -5, --mqtt5		Use MQTT v5, with topic aliases for frequent topics\n"
+	" -P, --state-prop	With -5, send the 0/1 value as user property 'on' of\n"
+	"			the state message, instead of on the alarm topic\n"
+	" -c, --count-prefix	Publish PREFIX/state/alrm/on for each alarm prefix too\n"
+	" -f, --state-file=FILE	Keep a snapshot of all alarms in FILE, for a warm start\n"
+	" -C, --cluster=GROUP	Share the alarms with the other instances of GROUP\n"
+	" -S, --summary		Publish all alarms of PREFIX in 1 retained PREFIX/$summary\n"
+	" -t, --timers		Run the timers of ITEM/timer too, like mqttimer, on the same items\n"
+	" -M, --max-items=N	Keep at most N items, and refuse new ones beyond that\n"
+	" -R, --replay=FILE	Replay the MQTT trace FILE on a simulated clock, without broker,\n"
+	"			and write the publishes to stdout\n"
+	" -p, --precise		Wake up with sub-msec precision and the lowest timer slack\n"
+	" -a, --coalesce=SECS	Wake up on multiples of SECS only, to sleep longer\n"
+	" -l, --slack=SECS	Delay a wakeup up to SECS to share it with another deadline,\n"
+	"			this is the timer slack of the process too\n"
 	"\n"
 	"Paramteres\n"
-	" PATTERN	A pattern to subscribe for (default alarms/+/+)\n"
+	" PATTERN	A pattern to subscribe for (default alarms/+/+ and alarms/$bulk,\n"
+	"		or alarms/+ with -t)\n"
 	;
 
 #ifdef _GNU_SOURCE
@@ -59,22 +86,51 @@ static struct option long_opts[] = {
 	{ "verbose", no_argument, NULL, 'v', },
 
 	{ "mqtt", required_argument, NULL, 'm', },
+	{ "id", required_argument, NULL, 'i', },
+	{ "mqtt5", no_argument, NULL, '5', },
+	{ "state-prop", no_argument, NULL, 'P', },
+	{ "count-prefix", no_argument, NULL, 'c', },
+	{ "state-file", required_argument, NULL, 'f', },
+	{ "cluster", required_argument, NULL, 'C', },
+	{ "summary", no_argument, NULL, 'S', },
+	{ "timers", no_argument, NULL, 't', },
+	{ "max-items", required_argument, NULL, 'M', },
+	{ "replay", required_argument, NULL, 'R', },
+	{ "precise", no_argument, NULL, 'p', },
+	{ "coalesce", required_argument, NULL, 'a', },
+	{ "slack", required_argument, NULL, 'l', },
 	{ },
 };
 #else
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "Vv?m:";
+static const char optstring[] = "Vv?m:i:5Pcf:C:StM:R:pa:l:";
 
 /* signal handler */
 static volatile int sigterm;
 
 /* MQTT parameters */
-static const char *mqtt_host = "localhost";
-static int mqtt_port = 1883;
 static int mqtt_keepalive = 10;
 static int mqtt_qos = 1;
+static const char *mqtt_id;
+static int mqtt_v5;
+static int mqtt_state_prop;
+/* subscription patterns, renewed on reconnect */
+static char **mqtt_patterns;
+static int mqtt_npatterns;
+static int count_prefix;
+static const char *state_file;
+static const char *cluster_group;
+static int summary;
+static int timers;
+static const char *replay_file;
+static int max_items;
+/* timer source */
+static int precise;
+static double coalesce, slack;
+/* reset value of timer specs without one */
+static const char timer_reset[] = "0";
 
 /* alarm states */
 static const char *const alrm_states[] = {
@@ -92,59 +148,286 @@ static const char *const alrm_states[] = {
 	[ALRM_ALL_DISABLED] = "disableall",
 };
 
+/* brokers, 1 per -m
+ * Each broker has its own connection, publish queue and alarms.
+ */
+struct broker {
+	char *host;
+	int port;
+	/* HOST:PORT, to log and to find it back in the snapshot */
+	char *name;
+	struct mosquitto *mosq;
+	int connected;
+	int connected_once;
+	double reconnect_delay;
+	/* mid of the pattern SUBSCRIBE, and whether it was acknowledged */
+	int patmid;
+	int subacked;
+	/* NULL for the default queue, which the first broker uses */
+	struct pubq *pubq;
+	/* socket as registered with epoll, -1 when none */
+	int sockfd;
+	/* alarm prefixes of this broker */
+	struct prefix *prefixes;
+	/* total number of alarms ON, as published */
+	int nalrmon;
+	int pubnalrmon;
+	int idx;
+};
+
+static struct broker *brokers;
+static int nbrokers;
+
 /* state */
-static struct mosquitto *mosq;
-/* timerfd */
-static int tfd;
+static int epfd;
+/* reconnect backoff */
+#define RECONNECT_MIN	1.0
+#define RECONNECT_MAX	60.0
+/* the alarm deadline of the timer source */
 static time_t tfd_setp;
 
-struct item {
-	struct item *next;
-	struct item *prev;
-
+METRIC(m_items, "items");
+METRIC(m_mem, "items.memory");
+METRIC(m_orphans, "items.orphans");
+METRIC(m_gc, "items.gc");
+METRIC(m_overflow, "items.overflow");
+METRIC(m_arms, "timerfd.arms");
+METRIC(m_timechanged, "time.changed");
+METRIC(m_settles, "settles");
+METRIC(m_bulkalarms, "bulk.alarms");
+METRIC(m_alrmlag, "alarm.lag");
+METRIC(m_timerlag, "timer.lag");
+METRIC(m_condevals, "condition.evals");
+METRIC(m_deps, "condition.topics");
+
+/* alarms are grouped by the topic before their name */
+struct prefix {
+	struct prefix *next;
+	struct broker *broker;
 	char *topic;
 	int topiclen;
-	int namepos; /* position in topic where name starts */
-	int hhmm;
-	int wdays; /* bitmask */
-	int valid; /* definition has been seen */
-	double maxtime;
+	/* items within this prefix */
+	struct item *items;
+	/* number of alarms ON, as published */
+	int non;
+	int pubnon;
+	char *ontopic;
+	/* summary needs to be rebuilt */
+	int sumdirty;
+	char *sumtopic;
+};
 
+/* items come from a slab, so a scan walks mostly adjacent memory
+ * The fields for scheduling come first, within 1 cache line.
+ */
+struct item {
+	time_t scheduled;
+	/* position in the sched heap, +1, 0 when not scheduled */
+	int heapidx;
 	int state;
 	/* flag to know if alarm was individually disabled */
 	int pubstate;
+	int hhmm;
+	int wdays; /* bitmask */
+	int valid; /* definition has been seen */
 	int snooze_time;
-	time_t scheduled;
+	/* pending work for the next settle pass */
+	int dirty;
+		#define DIRTY_SCHED	0x01 /* compute next_alarm() */
+		#define DIRTY_PUB	0x02 /* publish state */
+		#define DIRTY_SUM	0x08 /* refresh summary line */
+	/* @prev points to the pointer that points to us */
+	struct item *next, **prev;
+	/* hash table collision chain */
+	struct item *hnext;
+	unsigned int hash;
+
+	/* base topic, with room to append a suffix in place */
+	char *topic;
+		#define ITEM_SUFFIXSIZE	16
+	int topiclen;
+	int namepos; /* position in topic where name starts */
+	struct prefix *pfx;
+	/* list within pfx */
+	struct item *pnext, **pprev;
+	double maxtime;
+	/* scheduled time, as published on /next */
+	time_t pubnext;
+	struct item *dnext;
+	/* this alarm's part of the summary */
+	char *sumline;
+	int sumlen;
+	/* timeout that fired while another cluster member owned this alarm */
+	void (*missed)(void *);
+	/* with -t: ITEM/timer spec, resets the item to tresetvalue after tdelay
+	 * tresetvalue is NULL without spec
+	 * tontime is NaN while reset, 0 once the reset is sent
+	 */
+	double tdelay;
+	double tontime;
+	char *tresetvalue;
+	int tresetlen;
+	int tmissed;
+	/* ITEM/condition, parsed once, and its last result */
+	struct rpn *cond;
+	int condval;
+	/* defined via PREFIX/$bulk, without retained attribute topics */
+	int bulk;
+	/* an orphan, without alarm or timer, at the last sweep */
+	int orphan;
+	/* created at, libt_now() */
+	double born;
+	/* a dropped orphan came back, fetch its attributes again */
+	int refetch;
+	/* values loaded from snapshot, not yet confirmed by MQTT */
+	int snap;
+		#define SNAP_ALARM	0x01
+		#define SNAP_REPEAT	0x02
+		#define SNAP_SNOOZETIME	0x04
+		#define SNAP_MAXTIME	0x08
+		#define SNAP_STATE	0x10
+		#define SNAP_ALL	0x1f
+		#define SNAP_TIMER	0x20
 };
 
 struct item *items;
+static struct slab item_slab = SLAB_INIT(struct item);
+/* topics and timer reset values */
+static struct arena strings;
+
+/* hash table of items, indexed by broker & base topic */
+static struct item **htab;
+static int htabsize;
+static int nitems;
+
+/* min-heap of scheduled items, earliest first */
+static struct item **sched;
+static int nsched, ssched;
+
+/* items with pending work */
+static struct item *dirtyitems;
+static int settle_pending;
+/* a skipped alarm passed, clear all skipped alarms */
+static int clear_skipped;
+/* maximum delay for settling when messages keep coming in */
+#define SETTLE_MAXDELAY	1.0
+
+/* snapshot writes are delayed, to combine changes */
+#define SNAPSHOT_DELAY	5.0
+/* time for the retained replay to confirm snapshot items */
+#define SNAPSHOT_GRACE	10.0
+static int snapshot_pending;
+static void save_snapshot(void *dat);
 
 static void reschedule_alrm(struct item *it);
+static void settle_items(void *dat);
+static void want_summary(struct prefix *pfx);
+static void on_alrm(void *dat);
 static void on_alrm_done(void *dat);
+static void on_timer(void *dat);
+static void drop_cond(struct item *it);
+static int sweep_orphans_now(void);
+static int gone_take(struct broker *b, const char *topic, int len, unsigned int hash);
 
 time_t next_alarm(const struct item *it, time_t tnow)
 {
-	struct tm tm;
-	time_t tnext;
-	int j;
+	return cal_next_hhmm(it->hhmm, it->wdays, tnow);
+}
+
+/* scheduled alarms heap */
+static inline void sched_put(struct item *it, int idx)
+{
+	sched[idx] = it;
+	it->heapidx = idx+1;
+}
+
+static void sched_up(int idx)
+{
+	struct item *it = sched[idx];
+	int parent;
+
+	for (; idx > 0; idx = parent) {
+		parent = (idx-1)/2;
+		if (sched[parent]->scheduled <= it->scheduled)
+			break;
+		sched_put(sched[parent], idx);
+	}
+	sched_put(it, idx);
+}
+
+static void sched_down(int idx)
+{
+	struct item *it = sched[idx];
+	int child;
 
-	tm = *localtime(&tnow);
-	tm.tm_hour = it->hhmm / 100;
-	tm.tm_min = it->hhmm % 100;
-	tm.tm_sec = 0;
-	tnext = mktime_dstsafe(&tm);
-	if (tnext <= (tnow + 1)) {
-		tm.tm_mday += 1;
-		tnext = mktime_dstsafe(&tm);
-	}
-	if (it->wdays)
-	for (j = 0; j < 7; ++j) {
-		if (it->wdays & (1 << tm.tm_wday))
+	for (; (child = idx*2+1) < nsched; idx = child) {
+		if (child+1 < nsched && sched[child+1]->scheduled < sched[child]->scheduled)
+			++child;
+		if (it->scheduled <= sched[child]->scheduled)
 			break;
-		tm.tm_mday += 1;
-		tnext = mktime_dstsafe(&tm);
+		sched_put(sched[child], idx);
+	}
+	sched_put(it, idx);
+}
+
+/* change the scheduled time of an item, and keep the heap in order
+ * @when == 0 removes the item from the heap
+ */
+static void set_scheduled(struct item *it, time_t when)
+{
+	int idx;
+
+	/* an explicit time overrules any pending computation */
+	it->dirty &= ~DIRTY_SCHED;
+	it->scheduled = when;
+	if (it->heapidx) {
+		idx = it->heapidx-1;
+		it->heapidx = 0;
+		/* remove, by moving the last one into its place */
+		if (--nsched > idx) {
+			sched_put(sched[nsched], idx);
+			sched_up(idx);
+			sched_down(sched[idx]->heapidx-1);
+		}
+	}
+	if (!when)
+		return;
+	if (nsched >= ssched) {
+		ssched = ssched ? ssched*2 : 64;
+		sched = realloc(sched, sizeof(*sched)*ssched);
+		if (!sched)
+			mylog(LOG_ERR, "realloc %u scheduled: %s", ssched, ESTR(errno));
+	}
+	sched_put(it, nsched++);
+	sched_up(nsched-1);
+}
+
+/* defer work to the next settle pass, which runs once the burst of
+ * incoming messages is processed
+ */
+static void want_settle(void)
+{
+	if (!settle_pending)
+		libt_add_timeout(SETTLE_MAXDELAY, settle_items, NULL);
+	settle_pending = 1;
+}
+
+static void want_snapshot(void)
+{
+	if (!state_file || snapshot_pending)
+		return;
+	libt_add_timeout(SNAPSHOT_DELAY, save_snapshot, NULL);
+	snapshot_pending = 1;
+}
+
+static void mark_dirty(struct item *it, int flags)
+{
+	want_settle();
+	if (!it->dirty) {
+		it->dnext = dirtyitems;
+		dirtyitems = it;
 	}
-	return tnext;
+	it->dirty |= flags;
 }
 
 /* MQTT iface */
@@ -168,97 +451,629 @@ static void my_mqtt_log(struct mosquitto *mosq, void *userdata, int level, const
 	}
 }
 
-static struct item *get_item(const char *topic, const char *suffix, int create)
+static void htab_grow(void)
 {
 	struct item *it;
-	int len;
+	int newsize = htabsize ? htabsize*2 : 64;
+
+	free(htab);
+	htab = malloc(sizeof(*htab)*newsize);
+	if (!htab)
+		mylog(LOG_ERR, "malloc %u items: %s", newsize, ESTR(errno));
+	memset(htab, 0, sizeof(*htab)*newsize);
+	htabsize = newsize;
+	/* rehash */
+	for (it = items; it; it = it->next) {
+		it->hnext = htab[it->hash & (htabsize-1)];
+		htab[it->hash & (htabsize-1)] = it;
+	}
+}
+
+static struct prefix *get_prefix(struct broker *b, const char *topic, int len)
+{
+	struct prefix *pfx;
+
+	for (pfx = b->prefixes; pfx; pfx = pfx->next) {
+		if (pfx->topiclen == len && !strncmp(pfx->topic, topic, len))
+			return pfx;
+	}
+	pfx = malloc(sizeof(*pfx));
+	if (!pfx)
+		mylog(LOG_ERR, "malloc prefix: %s", ESTR(errno));
+	memset(pfx, 0, sizeof(*pfx));
+	pfx->broker = b;
+	pfx->topic = strndup(topic, len);
+	if (!pfx->topic)
+		mylog(LOG_ERR, "strndup prefix: %s", ESTR(errno));
+	pfx->topiclen = len;
+	pfx->pubnon = -1;
+	if (len) {
+		asprintf(&pfx->ontopic, "%s/state/alrm/on", pfx->topic);
+		asprintf(&pfx->sumtopic, "%s/$summary", pfx->topic);
+	}
+	pfx->next = b->prefixes;
+	b->prefixes = pfx;
+	return pfx;
+}
+
+/* the same topic on another broker is another item
+ * The broker index is mixed in, so those do not share a hash chain.
+ * Broker 0, the only one in a cluster, hashes like the bare topic.
+ */
+static inline unsigned int item_hash(struct broker *b, const char *topic, int len)
+{
+	return strhash(topic, len) ^ (b->idx * 0x9e3779b1U);
+}
+
+static void metric_items(void)
+{
+	metric_set(&m_items, nitems);
+	/* the item memory, without the items' strings beyond the arena */
+	metric_set(&m_mem, slab_bytes(&item_slab) + arena_bytes(&strings) +
+			sizeof(*htab)*htabsize + sizeof(*sched)*ssched);
+}
+
+static struct item *get_item(struct broker *b, const char *topic, int len, int create)
+{
+	struct item *it;
+	unsigned int hash;
 
-	len = strlen(topic ?: "") - strlen(suffix ?: "");
 	if (len <= 0)
 		return NULL;
-	if (strcmp(topic+len, suffix) != 0)
-		return NULL;
 
-	for (it = items; it; it = it->next) {
-		if ((it->topiclen == len) && !strncmp(it->topic ?: "", topic, len))
+	hash = item_hash(b, topic, len);
+	if (htabsize)
+	for (it = htab[hash & (htabsize-1)]; it; it = it->hnext) {
+		if ((it->hash == hash) && (it->topiclen == len) && !strncmp(it->topic, topic, len) &&
+				it->pfx->broker == b)
 			return it;
 	}
 
 	if (!create)
 		return NULL;
+	if (max_items && nitems >= max_items && (!sweep_orphans_now() || nitems >= max_items)) {
+		metric_inc(&m_overflow);
+		mylog(LOG_WARNING, "%u items, refused '%.*s'", nitems, len, topic);
+		return NULL;
+	}
 
 	/* not found, create one */
-	it = malloc(sizeof(*it));
-	memset(it, 0, sizeof(*it));
+	it = slab_alloc(&item_slab);
+	if (!it)
+		mylog(LOG_ERR, "alloc item: %s", ESTR(errno));
 	it->pubstate = -1; /* make it never match */
-	/* assign dup'd topic to item, no need to dup twice, no need to free */
-	it->topic = strndup(topic, len);
-	it->topiclen = strlen(it->topic);
+	it->topic = arena_strndup(&strings, topic, len, ITEM_SUFFIXSIZE);
+	if (!it->topic)
+		mylog(LOG_ERR, "alloc topic: %s", ESTR(errno));
+	it->topiclen = len;
+	it->hash = hash;
+	it->born = libt_now();
+	it->refetch = gone_take(b, topic, len, hash);
 	char *name = strrchr(it->topic, '/');
 	if (name)
 		it->namepos = name - it->topic +1;
 	else
 		it->namepos = 0;
+	it->pfx = get_prefix(b, it->topic, it->namepos ? it->namepos-1 : 0);
 
 	it->maxtime = 3600;
+	it->tdelay = it->tontime = NAN;
+	it->condval = 1;
 
 	/* insert in linked list */
 	it->next = items;
-	if (it->next) {
-		it->prev = it->next->prev;
-		it->next->prev = it;
-	} else
-		it->prev = (struct item *)(((char *)&items) - offsetof(struct item, next));
-	it->prev->next = it;
+	if (it->next)
+		it->next->prev = &it->next;
+	it->prev = &items;
+	items = it;
+
+	/* insert in prefix list */
+	it->pnext = it->pfx->items;
+	if (it->pnext)
+		it->pnext->pprev = &it->pnext;
+	it->pprev = &it->pfx->items;
+	it->pfx->items = it;
+
+	/* insert in hash table, keep load factor below 1 */
+	if (++nitems > htabsize)
+		htab_grow();
+	else {
+		it->hnext = htab[hash & (htabsize-1)];
+		htab[hash & (htabsize-1)] = it;
+	}
+	metric_items();
 	return it;
 }
 
 static void drop_item(struct item *it)
 {
-	if (it->prev)
-		it->prev->next = it->next;
+	struct item **pit;
+
+	set_scheduled(it, 0);
+	libt_remove_timeout(on_alrm, it);
+	libt_remove_timeout(on_alrm_done, it);
+	libt_remove_timeout(on_timer, it);
+	drop_cond(it);
+	if (it->dirty) {
+		for (pit = &dirtyitems; *pit; pit = &(*pit)->dnext) {
+			if (*pit == it) {
+				*pit = it->dnext;
+				break;
+			}
+		}
+	}
+
+	for (pit = &htab[it->hash & (htabsize-1)]; *pit; pit = &(*pit)->hnext) {
+		if (*pit == it) {
+			*pit = it->hnext;
+			break;
+		}
+	}
+	--nitems;
+	metric_items();
+	want_snapshot();
+	if (it->pubstate == ALRM_ON) {
+		/* published state is removed too */
+		--it->pfx->non;
+		--it->pfx->broker->nalrmon;
+		want_settle();
+	}
+	*it->prev = it->next;
 	if (it->next)
 		it->next->prev = it->prev;
-	free(it->topic);
-	free(it);
+	*it->pprev = it->pnext;
+	if (it->pnext)
+		it->pnext->pprev = it->pprev;
+	if (summary)
+		want_summary(it->pfx);
+	free(it->sumline);
+	arena_free(&strings, it->tresetvalue, it->tresetlen+1);
+	arena_free(&strings, it->topic, it->topiclen+1+ITEM_SUFFIXSIZE);
+	slab_free(&item_slab, it);
+}
+
+/* orphans
+ * /repeat, /state and alike create an item before its /alarm arrives,
+ * a noisy tree may never send that /alarm.
+ * Items that stay orphaned during a whole sweep interval are dropped,
+ * retained topics are left alone.
+ * The topics of dropped items are remembered: when such an alarm
+ * arrives anyway, its retained attributes are fetched again.
+ */
+#define ORPHAN_SWEEP	300.0
+#define REFETCH_TIME	10.0
+/* remembered topics, the oldest are forgotten first */
+#define GONE_MAX	16384
+#define GONE_SLOTS	4096
+static double forced_sweep;
+
+struct gone {
+	struct gone *hnext;
+	/* in order of dropping */
+	struct gone *next;
+	struct broker *b;
+	unsigned int hash;
+	int len;
+	char topic[1];
+};
+
+static struct gone *gonetab[GONE_SLOTS];
+static struct gone *gonehead, **gonetail = &gonehead;
+static int ngone;
+
+static void gone_unlink(struct gone *g)
+{
+	struct gone **pg;
+
+	for (pg = &gonetab[g->hash & (GONE_SLOTS-1)]; *pg; pg = &(*pg)->hnext) {
+		if (*pg == g) {
+			*pg = g->hnext;
+			break;
+		}
+	}
+	/* the FIFO is unlinked by the caller */
+	--ngone;
+	free(g);
+}
+
+static void gone_add(struct item *it)
+{
+	struct gone *g;
+
+	if (ngone >= GONE_MAX) {
+		g = gonehead;
+		gonehead = g->next;
+		if (!gonehead)
+			gonetail = &gonehead;
+		gone_unlink(g);
+	}
+	g = malloc(sizeof(*g) + it->topiclen);
+	if (!g)
+		mylog(LOG_ERR, "malloc dropped topic: %s", ESTR(errno));
+	g->b = it->pfx->broker;
+	g->hash = it->hash;
+	g->len = it->topiclen;
+	memcpy(g->topic, it->topic, it->topiclen);
+	g->topic[g->len] = 0;
+	g->hnext = gonetab[g->hash & (GONE_SLOTS-1)];
+	gonetab[g->hash & (GONE_SLOTS-1)] = g;
+	g->next = NULL;
+	*gonetail = g;
+	gonetail = &g->next;
+	++ngone;
+}
+
+/* forget a dropped topic, returns whether it was dropped */
+static int gone_take(struct broker *b, const char *topic, int len, unsigned int hash)
+{
+	struct gone *g, **pg;
+
+	if (!ngone)
+		return 0;
+	for (g = gonetab[hash & (GONE_SLOTS-1)]; g; g = g->hnext) {
+		if (g->hash == hash && g->b == b && g->len == len && !memcmp(g->topic, topic, len))
+			break;
+	}
+	if (!g)
+		return 0;
+	for (pg = &gonehead; *pg != g; pg = &(*pg)->next);
+	*pg = g->next;
+	if (gonetail == &g->next)
+		gonetail = pg;
+	gone_unlink(g);
+	return 1;
+}
+
+static inline int item_orphaned(const struct item *it)
+{
+	return !it->valid && !it->tresetvalue && !it->snap && it->pubstate != ALRM_ON;
+}
+
+/* drop the orphans,
+ * with @force also those that were not flagged yet, but are older than
+ * a sweep interval. The retained replay may not have finished for
+ * younger items.
+ */
+static int sweep(int force)
+{
+	struct item *it, *next;
+	int n = 0, norphans = 0;
+
+	for (it = items; it; it = next) {
+		next = it->next;
+		if (!item_orphaned(it))
+			it->orphan = 0;
+		else if (it->orphan || (force && libt_now() - it->born >= ORPHAN_SWEEP)) {
+			gone_add(it);
+			drop_item(it);
+			++n;
+		} else {
+			/* a forced sweep is no sweep interval */
+			if (!force)
+				it->orphan = 1;
+			++norphans;
+		}
+	}
+	metric_set(&m_orphans, norphans);
+	metric_add(&m_gc, n);
+	if (n)
+		mylog(LOG_INFO, "dropped %u orphaned items", n);
+	return n;
+}
+
+static void sweep_orphans(void *dat)
+{
+	sweep(0);
+	libt_add_timeout(ORPHAN_SWEEP, sweep_orphans, NULL);
+}
+
+/* make room at the item limit, at most once per second */
+static int sweep_orphans_now(void)
+{
+	if (libt_now() < forced_sweep + 1)
+		return 0;
+	forced_sweep = libt_now();
+	return sweep(1);
+}
+
+struct refetch {
+	struct broker *b;
+	char pattern[1];
+};
+
+static void refetch_done(void *dat)
+{
+	struct refetch *r = dat;
+
+	if (r->b->connected)
+		mosquitto_unsubscribe(r->b->mosq, NULL, r->pattern);
+	free(r);
+}
+
+/* subscribe ITEM/+ for a while, so the broker sends its retained attributes again */
+static void refetch_item(struct item *it)
+{
+	struct broker *b = it->pfx->broker;
+	struct refetch *r;
+	int ret;
+
+	if (!it->refetch || !b->connected)
+		/* never dropped, or the broker is away */
+		return;
+	it->refetch = 0;
+	r = malloc(sizeof(*r) + it->topiclen + 2);
+	if (!r)
+		mylog(LOG_ERR, "malloc refetch: %s", ESTR(errno));
+	r->b = b;
+	sprintf(r->pattern, "%s/+", it->topic);
+	ret = mosquitto_subscribe(b->mosq, NULL, r->pattern, mqtt_qos);
+	if (ret) {
+		mylog(LOG_WARNING, "mosquitto_subscribe %s: %s", r->pattern, mosquitto_strerror(ret));
+		free(r);
+		return;
+	}
+	mylog(LOG_INFO, "refetch '%s', it was an orphan", it->topic);
+	libt_add_timeout(REFETCH_TIME, refetch_done, r);
+}
+
+/* revert an item to a bare timer, without alarm */
+static void forget_alrm(struct item *it)
+{
+	set_scheduled(it, 0);
+	libt_remove_timeout(on_alrm, it);
+	libt_remove_timeout(on_alrm_done, it);
+	it->missed = NULL;
+	it->valid = 0;
+	it->hhmm = it->wdays = 0;
+	it->snooze_time = 0;
+	it->maxtime = 3600;
+	it->bulk = 0;
+	drop_cond(it);
+	if (it->pubstate == ALRM_ON) {
+		/* published state is removed too */
+		--it->pfx->non;
+		--it->pfx->broker->nalrmon;
+		want_settle();
+	}
+	it->state = ALRM_OFF;
+	/* clear_item() removed /state and /next */
+	it->pubstate = -1;
+	it->pubnext = 0;
+	it->dirty &= ~DIRTY_PUB;
+	want_snapshot();
+	if (summary) {
+		free(it->sumline);
+		it->sumline = NULL;
+		it->sumlen = 0;
+		want_summary(it->pfx);
+	}
+}
+
+/* in a cluster, only the owner acts on an alarm and publishes it */
+static inline int item_owned(const struct item *it)
+{
+	return cluster_owns(it->hash);
+}
+
+/* publish on the topic of an item + @suffix
+ * The topic is composed in the item's buffer, without allocation
+ */
+static void pub_item_prop(struct item *it, const char *suffix, const char *payload,
+		const char *propname, const char *propvalue)
+{
+	if (!item_owned(it))
+		return;
+	strcpy(it->topic + it->topiclen, suffix);
+	pubq_select(it->pfx->broker->pubq);
+	pubq_add_prop(it->topic, payload, strlen(payload ?: ""), 1, propname, propvalue);
+	it->topic[it->topiclen] = 0;
+}
+
+static void pub_item(struct item *it, const char *suffix, const char *payload)
+{
+	pub_item_prop(it, suffix, payload, NULL, NULL);
 }
 
 static void pub_alrm_state(struct item *it)
 {
 	const char *state = alrm_states[it->state];
-	static int lastcnt = -1;
-
-	if (it->pubstate != it->state)
-		mosquitto_publish(mosq, NULL, csprintf("%s/state", it->topic),
-				strlen(state), state, mqtt_qos, 1);
-	if ((it->pubstate == ALRM_ON) != (it->state == ALRM_ON))
-		mosquitto_publish(mosq, NULL, it->topic,
-				1, (it->state == ALRM_ON) ? "1" : "0", mqtt_qos, 1);
+
+	if (mqtt_state_prop) {
+		/* 1 packet, the ON value changes only with the state */
+		if (it->pubstate != it->state)
+			pub_item_prop(it, "/state", state, "on", (it->state == ALRM_ON) ? "1" : "0");
+	} else if (it->pubstate != it->state)
+		pub_item(it, "/state", state);
+	if ((it->pubstate == ALRM_ON) != (it->state == ALRM_ON)) {
+		if (!mqtt_state_prop)
+			pub_item(it, "", (it->state == ALRM_ON) ? "1" : "0");
+		/* maintain ON counters */
+		if (it->state == ALRM_ON) {
+			++it->pfx->non;
+			++it->pfx->broker->nalrmon;
+		} else if (it->pubstate == ALRM_ON) {
+			--it->pfx->non;
+			--it->pfx->broker->nalrmon;
+		}
+	}
 	if (it->pubstate != ALRM_ON && it->state == ALRM_ON)
 		/* schedule turn-off */
 		libt_add_timeout(it->maxtime, on_alrm_done, it);
 	else if (it->pubstate == ALRM_ON && it->state != ALRM_ON)
 		libt_remove_timeout(on_alrm_done, it);
 	it->pubstate = it->state;
+}
 
-	/* publish total count */
-	int n;
-	for (it = items, n = 0; it; it = it->next)
-		if (it->state == ALRM_ON)
-			++n;
+static void pub_count(struct broker *b, const char *topic, int n)
+{
+	char sval[32];
+
+	sprintf(sval, "%i", n);
+	pubq_select(b->pubq);
+	pubq_add(topic, sval, strlen(sval), 1);
+}
+
+static void pub_alrm_next(struct item *it)
+{
+	char sval[32];
+
+	/* epoch, empty when not scheduled */
+	if (it->scheduled)
+		sprintf(sval, "%lli", (long long)it->scheduled);
+	else
+		sval[0] = 0;
+	pub_item(it, "/next", sval);
+	it->pubnext = it->scheduled;
+}
+
+static void pub_alrm_count(void)
+{
+	struct broker *b;
+	struct prefix *pfx;
+
+	/* every member counts all alarms, the leader publishes */
+	if (!cluster_leader())
+		return;
+	for (b = brokers; b < brokers+nbrokers; ++b) {
+		/* publish total count */
+		if (b->nalrmon != b->pubnalrmon) {
+			pub_count(b, "state/alrm/on", b->nalrmon);
+			b->pubnalrmon = b->nalrmon;
+		}
+		if (!count_prefix)
+			continue;
+		for (pfx = b->prefixes; pfx; pfx = pfx->next) {
+			if (pfx->ontopic && pfx->non != pfx->pubnon) {
+				pub_count(b, pfx->ontopic, pfx->non);
+				pfx->pubnon = pfx->non;
+			}
+		}
+	}
+}
+
+/* summaries
+ * Each item caches its JSON member, a summary joins those of a prefix.
+ * The settle pass publishes the changed summaries, at most every
+ * SUMMARY_DELAY.
+ */
+#define SUMMARY_DELAY	2.0
+static int summary_pending;
+static double summary_last = -SUMMARY_DELAY;
+
+static void pub_summaries(void *dat)
+{
+	struct broker *b;
+	struct prefix *pfx;
+	struct item *it;
+	char *buf;
+	int len;
+
+	libt_remove_timeout(pub_summaries, NULL);
+	if (libt_now() < summary_last + SUMMARY_DELAY) {
+		libt_add_timeouta(summary_last + SUMMARY_DELAY, pub_summaries, NULL);
+		return;
+	}
+	summary_last = libt_now();
+	summary_pending = 0;
+	if (!cluster_leader())
+		return;
+	for (b = brokers; b < brokers+nbrokers; ++b)
+	for (pfx = b->prefixes; pfx; pfx = pfx->next) {
+		if (!pfx->sumdirty || !pfx->sumtopic)
+			continue;
+		pfx->sumdirty = 0;
+		pubq_select(b->pubq);
+		if (!pfx->items) {
+			/* remove the summary */
+			pubq_add(pfx->sumtopic, NULL, 0, 1);
+			continue;
+		}
+		for (len = 2, it = pfx->items; it; it = it->pnext)
+			len += it->sumlen + 1;
+		buf = malloc(len);
+		if (!buf)
+			mylog(LOG_ERR, "malloc summary: %s", ESTR(errno));
+		for (len = 0, it = pfx->items; it; it = it->pnext) {
+			if (!it->sumline)
+				continue;
+			buf[len] = len ? ',' : '{';
+			++len;
+			memcpy(buf+len, it->sumline, it->sumlen);
+			len += it->sumlen;
+		}
+		if (!len)
+			buf[len++] = '{';
+		buf[len++] = '}';
+		pubq_add(pfx->sumtopic, buf, len, 1);
+		free(buf);
+	}
+}
+
+static void want_summary(struct prefix *pfx)
+{
+	pfx->sumdirty = 1;
+	if (!summary_pending)
+		want_settle();
+	summary_pending = 1;
+}
 
-	if (n != lastcnt) {
-		char sval[32];
-		sprintf(sval, "%i", n);
-		mosquitto_publish(mosq, NULL, "state/alrm/on", strlen(sval), sval, mqtt_qos, 1);
-		lastcnt = n;
+static void update_sumline(struct item *it)
+{
+	char name[6*strlen(it->topic + it->namepos)+1], *str, *line;
+	const unsigned char *src;
+	char repeat[8], hhmm[32], maxtime[32];
+	int j, len;
+
+	/* escape the name for JSON */
+	for (str = name, src = (const unsigned char *)it->topic + it->namepos; *src; ++src) {
+		if (*src < 0x20)
+			str += sprintf(str, "\\u%04x", *src);
+		else if (strchr("\"\\", *src)) {
+			*str++ = '\\';
+			*str++ = *src;
+		} else
+			*str++ = *src;
+	}
+	*str = 0;
+	for (j = 0; j < 7; ++j)
+		repeat[j] = (it->wdays & (1 << ((j+1) % 7))) ? "mtwtfss"[j] : '-';
+	repeat[it->wdays ? 7 : 0] = 0;
+	if (it->valid)
+		snprintf(hhmm, sizeof(hhmm), "%02i:%02i", it->hhmm / 100, it->hhmm % 100);
+	else
+		hhmm[0] = 0;
+	/* JSON has no inf or nan */
+	if (isfinite(it->maxtime))
+		snprintf(maxtime, sizeof(maxtime), "%g", it->maxtime);
+	else
+		strcpy(maxtime, "null");
+
+	len = asprintf(&line, "\"%s\":{\"alarm\":\"%s\",\"repeat\":\"%s\",\"state\":\"%s\",\"on\":%i,"
+			"\"next\":%lli,\"snoozetime\":%i,\"maxtime\":%s}",
+			name, hhmm, repeat, alrm_states[it->state], it->state == ALRM_ON,
+			(long long)it->scheduled, it->snooze_time, maxtime);
+	if (len < 0)
+		mylog(LOG_ERR, "asprintf summary: %s", ESTR(errno));
+	if (it->sumline && len == it->sumlen && !memcmp(line, it->sumline, len)) {
+		/* the summary remains */
+		free(line);
+		return;
 	}
+	free(it->sumline);
+	it->sumline = line;
+	it->sumlen = len;
+	want_summary(it->pfx);
 }
 
 /* timeout handlers */
 static void on_alrm_done(void *dat)
 {
 	struct item *it = dat;
+
+	if (!item_owned(it)) {
+		it->missed = on_alrm_done;
+		return;
+	}
 	/* done with alrm, turn off */
 	mylog(LOG_INFO, "done '%s'", it->topic);
 	reschedule_alrm(dat);
@@ -268,22 +1083,32 @@ static void on_alrm(void *dat)
 {
 	struct item *it = dat;
 
+	if (!item_owned(it)) {
+		/* the owner will publish the outcome */
+		it->missed = on_alrm;
+		return;
+	}
+
 	if (it->state == ALRM_SKIP) {
 		mylog(LOG_INFO, "skip '%s'", it->topic);
-		/* clear ALL skipped alarms */
-		for (it = items; it; it = it->next) {
-			if (it->state == ALRM_SKIP) {
-				it->state = ALRM_OFF;
-				pub_alrm_state(it);
-				reschedule_alrm(it);
-			}
-		}
+		/* clear ALL skipped alarms, in the settle pass */
+		clear_skipped = 1;
+		want_settle();
+		return;
+	}
+	if (it->state == ALRM_OFF && !it->condval) {
+		/* snoozed alarms raise regardless */
+		mylog(LOG_INFO, "suppress '%s', condition is false", it->topic);
+		if (!it->wdays)
+			/* a one-shot alarm is used up, as when it raised */
+			it->state = ALRM_DISABLED;
+		reschedule_alrm(it);
 		return;
 	}
 	mylog(LOG_INFO, "raise '%s'", it->topic);
-	it->scheduled = 0;
+	set_scheduled(it, 0);
 	it->state = ALRM_ON;
-	pub_alrm_state(it);
+	mark_dirty(it, DIRTY_PUB);
 }
 
 static void snooze_alrm(struct item *it)
@@ -297,62 +1122,449 @@ static void snooze_alrm(struct item *it)
 	libt_add_timeout(it->snooze_time, on_alrm, it);
 	mylog(LOG_INFO, "snoozed %s for %us", it->topic, it->snooze_time);
 	it->state = ALRM_SNOOZED;
-	pub_alrm_state(it);
+	mark_dirty(it, DIRTY_PUB);
 }
 
-static void arm_timerfd(void)
+/* timers, with -t
+ * These follow mqttimer: once ITEM leaves its reset value,
+ * it is published back to the reset value after the delay of ITEM/timer.
+ */
+static void on_timer(void *dat)
 {
-	time_t next = 0;
-	int ret;
-	struct item *it;
+	struct item *it = dat;
 
-	/* walk over items, and find the earliest alarm */
-	for (it = items; it; it = it->next) {
-		if (it->scheduled && (!next || it->scheduled < next))
-			next = it->scheduled;
-	}
-	/* schedule timerfd */
-	struct itimerspec spec = {
-		.it_value = {
-			.tv_sec = next,
-		},
-	};
-	ret = timerfd_settime(tfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL);
-	if (ret < 0)
-		mylog(LOG_ERR, "timerfd_settime: %s", ESTR(errno));
-	tfd_setp = next;
+	if (!item_owned(it)) {
+		/* the owner will reset it */
+		it->tmissed = 1;
+		return;
+	}
+	it->tmissed = 0;
+	if (!isnan(it->tontime) && it->tontime)
+		metric_lag(&m_timerlag, libt_now() - it->tontime - it->tdelay);
+	/* the queue holds it while disconnected */
+	pub_item(it, "", it->tresetvalue);
+	it->tontime = 0;
+	want_snapshot();
+	mylog(LOG_INFO, "%s = %s", it->topic, it->tresetvalue);
 }
 
-static void time_changed(void)
+static void set_timer(struct item *it)
 {
-	struct item *it;
-	time_t tnow;
-
-	mylog(LOG_WARNING, "time change detected, rescheduling ...");
-	time(&tnow);
-	for (it = items; it; it = it->next) {
-		if (it->scheduled && it->scheduled >= tnow && it->scheduled < tnow+(it->snooze_time ?: 60))
-			/* fire the alarm right here */
-			on_alrm(it);
-		else if (it->scheduled) {
-			/* recalculate, only when it was already scheduled */
-			it->scheduled = next_alarm(it, tnow);
-			mylog(LOG_INFO, "scheduled '%s' in %lus", it->topic, it->scheduled - tnow);
-		}
+	libt_remove_timeout(on_timer, it);
+	if (!isnan(it->tdelay) && !isnan(it->tontime) && it->tontime) {
+		libt_add_timeouta(it->tontime + it->tdelay, on_timer, it);
+		mylog(LOG_INFO, "%s: schedule action in %.2lfs", it->topic, it->tdelay);
 	}
-	/* arm the timerfd is done in main() */
 }
 
-/* dismiss & reschedule do the same thing */
-#define dismiss_alrm reschedule_alrm
-static void reschedule_alrm(struct item *it)
+static void drop_timer(struct item *it)
 {
-	libt_remove_timeout(on_alrm, it);
-	it->scheduled = 0;
+	libt_remove_timeout(on_timer, it);
+	arena_free(&strings, it->tresetvalue, it->tresetlen+1);
+	it->tresetvalue = NULL;
+	it->tresetlen = 0;
+	it->tdelay = it->tontime = NAN;
+	it->tmissed = 0;
+	want_snapshot();
+}
 
-	switch (it->state) {
-	case ALRM_DISABLED:
-	case ALRM_ALL_DISABLED:
+static void set_timer_reset(struct item *it, const char *str, int len)
+{
+	arena_free(&strings, it->tresetvalue, it->tresetlen+1);
+	it->tresetvalue = arena_strndup(&strings, str, len, 0);
+	if (!it->tresetvalue)
+		mylog(LOG_ERR, "alloc reset value: %s", ESTR(errno));
+	it->tresetlen = len;
+}
+
+/* process timeout spec: DELAY [RESETVALUE] */
+static void timer_spec(struct item *it, const char *str, int n)
+{
+	int used;
+
+	for (; n && strchr(" \t", *str); ++str, --n);
+	if (n) {
+		it->tdelay = strncasetodelay(str, n, &used);
+		/* skip remainder of token */
+		for (; used < n && !strchr(" \t", str[used]); ++used);
+		str += used;
+		n -= used;
+	} else
+		it->tdelay = NAN;
+
+	for (; n && strchr(" \t", *str); ++str, --n);
+	for (used = 0; used < n && !strchr(" \t", str[used]); ++used);
+	if (used)
+		set_timer_reset(it, str, used);
+	else
+		set_timer_reset(it, timer_reset, strlen(timer_reset));
+	mylog(LOG_INFO, "timer spec for %s: %.2lfs '%s'", it->topic, it->tdelay, it->tresetvalue);
+	set_timer(it);
+	want_snapshot();
+}
+
+/* a new value of ITEM */
+static void timer_value(struct item *it, const char *payload, int len)
+{
+	if (it->tresetlen == len && !memcmp(it->tresetvalue, payload, len)) {
+		/* value was reset */
+		libt_remove_timeout(on_timer, it);
+		it->tmissed = 0;
+		it->tontime = NAN;
+		want_snapshot();
+	} else if (isnan(it->tontime)) {
+		/* set ontime only on first set */
+		it->tontime = libt_now();
+		set_timer(it);
+		want_snapshot();
+	}
+}
+
+/* conditions, ITEM/condition
+ * A condition is an RPN program, parsed once when it arrives.
+ * The topics it reads are subscribed on the item's broker, and
+ * the condition is evaluated again only when one of them changes.
+ * on_alrm() just tests the last result.
+ */
+struct depref {
+	struct depref *next;
+	struct item *it;
+	/* number of lookups of this topic in the condition */
+	int n;
+};
+
+struct dep {
+	struct dep *hnext;
+	unsigned int hash;
+	struct broker *broker;
+	char *topic;
+	double value;
+	/* items whose condition reads this topic */
+	struct depref *refs;
+};
+
+static struct dep **deptab;
+static int deptabsize;
+static int ndeps;
+static struct stack rpnstack;
+
+static void deptab_grow(void)
+{
+	struct dep **newtab, *d, *next;
+	int newsize = deptabsize ? deptabsize*2 : 64;
+	int j;
+
+	newtab = malloc(sizeof(*newtab)*newsize);
+	if (!newtab)
+		mylog(LOG_ERR, "malloc %u condition topics: %s", newsize, ESTR(errno));
+	memset(newtab, 0, sizeof(*newtab)*newsize);
+	for (j = 0; j < deptabsize; ++j) {
+		for (d = deptab[j]; d; d = next) {
+			next = d->hnext;
+			d->hnext = newtab[d->hash & (newsize-1)];
+			newtab[d->hash & (newsize-1)] = d;
+		}
+	}
+	free(deptab);
+	deptab = newtab;
+	deptabsize = newsize;
+}
+
+static struct dep *get_dep(struct broker *b, const char *topic, int create)
+{
+	struct dep *d;
+	unsigned int hash;
+	int ret;
+
+	hash = item_hash(b, topic, strlen(topic));
+	if (deptabsize)
+	for (d = deptab[hash & (deptabsize-1)]; d; d = d->hnext) {
+		if (d->hash == hash && d->broker == b && !strcmp(d->topic, topic))
+			return d;
+	}
+	if (!create)
+		return NULL;
+	d = malloc(sizeof(*d));
+	if (!d)
+		mylog(LOG_ERR, "malloc condition topic: %s", ESTR(errno));
+	memset(d, 0, sizeof(*d));
+	d->hash = hash;
+	d->broker = b;
+	d->topic = strdup(topic);
+	metric_set(&m_deps, ndeps+1);
+	if (++ndeps > deptabsize)
+		deptab_grow();
+	d->hnext = deptab[hash & (deptabsize-1)];
+	deptab[hash & (deptabsize-1)] = d;
+	if (b->connected) {
+		/* the retained value follows */
+		ret = mosquitto_subscribe(b->mosq, NULL, d->topic, mqtt_qos);
+		if (ret)
+			mylog(LOG_WARNING, "mosquitto_subscribe %s: %s", d->topic, mosquitto_strerror(ret));
+	}
+	return d;
+}
+
+static void drop_dep(struct dep *d)
+{
+	struct dep **pd;
+
+	for (pd = &deptab[d->hash & (deptabsize-1)]; *pd; pd = &(*pd)->hnext) {
+		if (*pd == d) {
+			*pd = d->hnext;
+			break;
+		}
+	}
+	metric_set(&m_deps, --ndeps);
+	if (d->broker->connected)
+		mosquitto_unsubscribe(d->broker->mosq, NULL, d->topic);
+	free(d->topic);
+	free(d);
+}
+
+/* renew the subscriptions, for a new session */
+static void subscribe_deps(struct broker *b)
+{
+	struct dep *d;
+	int j, ret;
+
+	for (j = 0; j < deptabsize; ++j) {
+		for (d = deptab[j]; d; d = d->hnext) {
+			if (d->broker != b)
+				continue;
+			ret = mosquitto_subscribe(b->mosq, NULL, d->topic, mqtt_qos);
+			if (ret)
+				mylog(LOG_WARNING, "mosquitto_subscribe %s: %s", d->topic, mosquitto_strerror(ret));
+		}
+	}
+}
+
+double rpn_lookup_env(const char *str, struct rpn *rpn)
+{
+	struct dep *d = rpn->cookie;
+
+	/* topics without value yet read as 0 */
+	return d ? d->value : 0;
+}
+
+static void eval_cond(struct item *it)
+{
+	int val;
+
+	metric_inc(&m_condevals);
+	rpn_stack_reset(&rpnstack);
+	if (rpn_run(&rpnstack, it->cond) || !rpnstack.n) {
+		/* a broken condition must not silence the alarm */
+		mylog(LOG_WARNING, "condition of '%s' failed, ignored", it->topic);
+		val = 1;
+	} else
+		val = rpnstack.v[rpnstack.n-1] != 0;
+	if (val != it->condval)
+		mylog(LOG_INFO, "condition of '%s' became %s", it->topic, val ? "true" : "false");
+	it->condval = val;
+}
+
+void rpn_run_again(void *dat)
+{
+	eval_cond(dat);
+}
+
+static void drop_cond(struct item *it)
+{
+	struct rpn *rpn;
+	struct dep *d;
+	struct depref **pref, *ref;
+
+	for (rpn = it->cond; rpn; rpn = rpn->next) {
+		d = rpn->cookie;
+		if (!d)
+			continue;
+		for (pref = &d->refs; *pref; pref = &(*pref)->next) {
+			if ((*pref)->it == it)
+				break;
+		}
+		ref = *pref;
+		if (--ref->n)
+			continue;
+		*pref = ref->next;
+		free(ref);
+		if (!d->refs)
+			drop_dep(d);
+	}
+	rpn_free_chain(it->cond);
+	it->cond = NULL;
+	it->condval = 1;
+}
+
+static void set_cond(struct item *it, const char *str, int len)
+{
+	char buf[len+1];
+	struct rpn *rpn;
+	struct dep *d;
+	struct depref *ref;
+
+	drop_cond(it);
+	if (!len) {
+		mylog(LOG_INFO, "removed condition of '%s'", it->topic);
+		return;
+	}
+	memcpy(buf, str, len);
+	buf[len] = 0;
+	it->cond = rpn_parse(buf, it);
+	if (!it->cond) {
+		mylog(LOG_WARNING, "bad condition for '%s': '%s'", it->topic, buf);
+		return;
+	}
+	/* link the lookups to their topic */
+	for (rpn = it->cond; rpn; rpn = rpn->next) {
+		if (!rpn->topic)
+			continue;
+		d = get_dep(it->pfx->broker, rpn->topic, 1);
+		rpn->cookie = d;
+		for (ref = d->refs; ref; ref = ref->next) {
+			if (ref->it == it)
+				break;
+		}
+		if (!ref) {
+			ref = malloc(sizeof(*ref));
+			if (!ref)
+				mylog(LOG_ERR, "malloc condition ref: %s", ESTR(errno));
+			ref->it = it;
+			ref->n = 0;
+			ref->next = d->refs;
+			d->refs = ref;
+		}
+		++ref->n;
+	}
+	mylog(LOG_INFO, "condition for '%s': '%s'", it->topic, buf);
+	eval_cond(it);
+}
+
+/* the value of a payload that conditions read:
+ * a number, on/true/yes for 1, off/false/no for 0
+ * returns -1 for other payloads
+ */
+static int dep_parse(const char *payload, int len, double *pvalue)
+{
+	static const char *const words[] = { "off", "on", "false", "true", "no", "yes", };
+	int j, used;
+
+	/* trailing whitespace, i.e. from echo */
+	for (; len && isspace(payload[len-1]); --len);
+	if (!len) {
+		/* removed, or never published */
+		*pvalue = 0;
+		return 0;
+	}
+	*pvalue = strntod(payload, len, &used);
+	if (used == len)
+		return 0;
+	for (j = 0; j < sizeof(words)/sizeof(words[0]); ++j) {
+		if (strlen(words[j]) == len && !strncasecmp(payload, words[j], len)) {
+			*pvalue = j % 2;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* a new value of a topic that conditions read */
+static void dep_value(struct broker *b, const char *topic, const char *payload, int len)
+{
+	struct dep *d;
+	struct depref *ref;
+	double value;
+
+	d = get_dep(b, topic, 0);
+	if (!d)
+		return;
+	if (dep_parse(payload, len, &value) < 0) {
+		/* keep the last value */
+		mylog(LOG_WARNING, "condition topic '%s': '%.*s' is no number", topic, len, payload);
+		return;
+	}
+	if (value == d->value)
+		return;
+	d->value = value;
+	for (ref = d->refs; ref; ref = ref->next)
+		eval_cond(ref->it);
+}
+
+static void arm_timerfd(void)
+{
+	time_t next;
+
+	/* the earliest alarm is on top of the heap */
+	next = nsched ? sched[0]->scheduled : 0;
+	if (next == tfd_setp)
+		/* timerfd is already correct */
+		return;
+	/* the main loop arms the timerfd, a replay tests tfd_setp itself */
+	tsource_set_wall(next);
+	metric_inc(&m_arms);
+	tfd_setp = next;
+}
+
+/* the timerfd expired at @setp */
+static void raise_due(time_t setp)
+{
+	struct item *it;
+
+	while (setp && nsched && sched[0]->scheduled <= setp) {
+		/* this alarm should fire now */
+		it = sched[0];
+		metric_lag(&m_alrmlag, wallclock() - it->scheduled);
+		set_scheduled(it, 0);
+		on_alrm(it);
+	}
+	/* re-arm, the timerfd has expired */
+	tfd_setp = -1;
+	arm_timerfd();
+}
+
+static void time_changed(void)
+{
+	struct item *it, **list;
+	time_t tnow;
+	int j, n;
+
+	mylog(LOG_WARNING, "time change detected, rescheduling ...");
+	metric_inc(&m_timechanged);
+	cal_reset();
+	tnow = wallclock();
+	/* only scheduled alarms are affected, walk a copy of the heap
+	 * since rescheduling reorders it
+	 */
+	n = nsched;
+	list = malloc(sizeof(*list)*(n ?: 1));
+	if (!list)
+		mylog(LOG_ERR, "malloc %u scheduled: %s", n, ESTR(errno));
+	memcpy(list, sched, sizeof(*list)*n);
+	for (j = 0; j < n; ++j) {
+		it = list[j];
+		if (it->scheduled >= tnow && it->scheduled < tnow+(it->snooze_time ?: 60))
+			/* fire the alarm right here */
+			on_alrm(it);
+		else {
+			/* recalculate, only when it was already scheduled */
+			set_scheduled(it, 0);
+			mark_dirty(it, DIRTY_SCHED);
+		}
+	}
+	free(list);
+	/* the settle pass arms the timerfd */
+}
+
+/* dismiss & reschedule do the same thing */
+#define dismiss_alrm reschedule_alrm
+static void reschedule_alrm(struct item *it)
+{
+	libt_remove_timeout(on_alrm, it);
+	set_scheduled(it, 0);
+
+	switch (it->state) {
+	case ALRM_DISABLED:
+	case ALRM_ALL_DISABLED:
 		break;
 	case ALRM_ON:
 	case ALRM_SNOOZED:
@@ -368,29 +1580,401 @@ static void reschedule_alrm(struct item *it)
 	case ALRM_SKIP:
 		if (!it->valid)
 			break;
-		time_t tnow;
-
-		time(&tnow);
-		it->scheduled = next_alarm(it, tnow);
-		mylog(LOG_INFO, "scheduled '%s' in %lus", it->topic, it->scheduled - tnow);
+		/* next_alarm() is computed during settle */
+		mark_dirty(it, DIRTY_SCHED);
 		break;
 	}
-	pub_alrm_state(it);
+	mark_dirty(it, DIRTY_PUB);
+}
+
+/* process all pending work in 1 pass */
+static void settle_items(void *dat)
+{
+	struct item *it;
+	time_t tnow;
+
+	libt_remove_timeout(settle_items, NULL);
+	if (!settle_pending)
+		return;
+	settle_pending = 0;
+	metric_inc(&m_settles);
+	if (!cluster_ready())
+		/* ownership is not known yet, joining the cluster settles */
+		return;
+	if (clear_skipped) {
+		clear_skipped = 0;
+		for (it = items; it; it = it->next) {
+			if (it->state == ALRM_SKIP) {
+				it->state = ALRM_OFF;
+				reschedule_alrm(it);
+			}
+		}
+	}
+	tnow = wallclock();
+	while (dirtyitems) {
+		it = dirtyitems;
+		dirtyitems = it->dnext;
+
+		if (it->dirty & DIRTY_SCHED) {
+			set_scheduled(it, next_alarm(it, tnow));
+			mylog(LOG_INFO, "scheduled '%s' in %lus", it->topic, it->scheduled - tnow);
+		}
+		if (it->dirty & DIRTY_PUB)
+			pub_alrm_state(it);
+		if (it->scheduled != it->pubnext)
+			pub_alrm_next(it);
+		if (summary)
+			update_sumline(it);
+		it->dirty = 0;
+	}
+	if (summary_pending)
+		pub_summaries(NULL);
+	pub_alrm_count();
 	arm_timerfd();
+	want_snapshot();
+}
+
+/* snapshot file layout */
+#define SNAPSHOT_MAGIC	"mqttalrm"
+#define SNAPSHOT_VERSION	3
+struct snaphdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t nrec;
+	uint32_t nbroker;
+	/* broker names follow, then the records */
+};
+#define SNAPHDR_SIZE	((sizeof(struct snaphdr) + 7) & ~7)
+
+/* broker name: length + HOST:PORT, padded to 8 bytes */
+struct snapbroker {
+	uint32_t namelen;
+};
+#define SNAPBROKER_SIZE(namelen) \
+	((sizeof(struct snapbroker) + (namelen) + 7) & ~7)
+
+struct snaprec {
+	int64_t scheduled;
+	double maxtime;
+	double tdelay;
+	/* wall clock time, 0 and NaN are kept as-is */
+	double tontime;
+	int32_t hhmm;
+	int32_t wdays;
+	int32_t valid;
+	int32_t state;
+	int32_t snooze_time;
+	int32_t topiclen;
+	/* -1 without timer */
+	int32_t tresetlen;
+	/* index in the broker names */
+	int32_t broker;
+	/* topic and timer reset value follow, padded to 8 bytes */
+};
+#define SNAPREC_SIZE(topiclen, resetlen) \
+	((sizeof(struct snaprec) + (topiclen) + (resetlen) + 7) & ~7)
+
+/* offset from libt's monotonic clock to wall clock */
+static double wallclock_offset(void)
+{
+	return wallclock() - libt_now();
+}
+
+static void save_snapshot(void *dat)
+{
+	struct snaphdr *hdr;
+	struct snapbroker *sb;
+	struct snaprec *rec;
+	struct broker *b;
+	struct item *it;
+	size_t len;
+	double offset;
+	char *buf;
+
+	libt_remove_timeout(save_snapshot, NULL);
+	snapshot_pending = 0;
+
+	len = SNAPHDR_SIZE;
+	for (b = brokers; b < brokers+nbrokers; ++b)
+		len += SNAPBROKER_SIZE(strlen(b->name));
+	for (it = items; it; it = it->next)
+		len += SNAPREC_SIZE(it->topiclen, it->tresetlen);
+	buf = malloc(len);
+	if (!buf)
+		mylog(LOG_ERR, "malloc snapshot: %s", ESTR(errno));
+	memset(buf, 0, len);
+	hdr = (void *)buf;
+	memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+	hdr->version = SNAPSHOT_VERSION;
+	hdr->nrec = nitems;
+	hdr->nbroker = nbrokers;
+	len = SNAPHDR_SIZE;
+	for (b = brokers; b < brokers+nbrokers; ++b) {
+		sb = (void *)(buf + len);
+		sb->namelen = strlen(b->name);
+		memcpy(sb+1, b->name, sb->namelen);
+		len += SNAPBROKER_SIZE(sb->namelen);
+	}
+	offset = wallclock_offset();
+	for (it = items; it; it = it->next) {
+		rec = (void *)(buf + len);
+		/* store the published state, that is what the broker has */
+		rec->scheduled = it->scheduled;
+		rec->maxtime = it->maxtime;
+		rec->hhmm = it->hhmm;
+		rec->wdays = it->wdays;
+		rec->valid = it->valid;
+		rec->state = (it->pubstate >= 0) ? it->pubstate : it->state;
+		rec->snooze_time = it->snooze_time;
+		rec->topiclen = it->topiclen;
+		rec->broker = it->pfx->broker->idx;
+		memcpy(rec+1, it->topic, it->topiclen);
+		rec->tresetlen = it->tresetvalue ? it->tresetlen : -1;
+		rec->tdelay = it->tdelay;
+		rec->tontime = (isnan(it->tontime) || !it->tontime) ? it->tontime : it->tontime + offset;
+		if (it->tresetvalue)
+			memcpy((char *)(rec+1) + it->topiclen, it->tresetvalue, it->tresetlen);
+		len += SNAPREC_SIZE(it->topiclen, it->tresetlen);
+	}
+	if (snapshot_save(state_file, buf, len) < 0)
+		mylog(LOG_WARNING, "save %s: %s", state_file, ESTR(errno));
+	free(buf);
 }
 
-static void alarm_cmd(struct item *it, const char *cmd, int for_all)
+/* remove an alarm completely */
+static void clear_item(struct item *it)
 {
-	if (!cmd) {
+	/* flush potential MQTT leftovers, $bulk alarms have none */
+	if (!it->bulk) {
+		pub_item(it, "/repeat", NULL);
+		pub_item(it, "/snoozetime", NULL);
+		pub_item(it, "/maxtime", NULL);
+		pub_item(it, "/condition", NULL);
+	}
+	pub_item(it, "/state", NULL);
+	pub_item(it, "/next", NULL);
+	if (it->tresetvalue) {
+		/* the timer keeps the item, and ITEM itself */
+		forget_alrm(it);
+		return;
+	}
+	pub_item(it, "", NULL);
+	drop_item(it);
+}
+
+/* drop the snapshot items of broker @dat that the retained replay
+ * did not confirm
+ * This is local only: the broker may still hold them, an empty
+ * retained publish would delete a user's alarm.
+ */
+static void expire_snapshot(void *dat)
+{
+	struct broker *b = dat;
+	struct item *it, *next;
+	int n = 0;
 
-	} else if (!strcmp(cmd, "dismiss")) {
+	for (it = items; it; it = next) {
+		next = it->next;
+		if (it->pfx->broker != b)
+			continue;
+		if (it->snap & SNAP_TIMER) {
+			mylog(LOG_INFO, "snapshot timer '%s' vanished", it->topic);
+			drop_timer(it);
+		}
+		if ((it->valid && (it->snap & SNAP_ALARM)) ||
+				((it->snap & SNAP_ALL) == SNAP_ALL && !it->tresetvalue)) {
+			mylog(LOG_INFO, "snapshot '%s' vanished", it->topic);
+			if (it->tresetvalue)
+				forget_alrm(it);
+			else
+				drop_item(it);
+			++n;
+			continue;
+		}
+		it->snap = 0;
+	}
+	if (n)
+		mylog(LOG_NOTICE, "dropped %u alarms of %s from snapshot", n, b->name);
+}
+
+static void load_snapshot(void)
+{
+	const struct snaphdr *hdr;
+	const struct snapbroker *sb;
+	const struct snaprec *rec;
+	const char *map;
+	struct broker *b, **bmap = NULL;
+	struct item *it;
+	size_t len, pos;
+	time_t tnow;
+	double offset;
+	int j, resetlen, nforeign = 0;
+
+	map = snapshot_map(state_file, &len);
+	if (!map) {
+		if (errno != ENOENT)
+			mylog(LOG_WARNING, "load %s: %s", state_file, ESTR(errno));
+		return;
+	}
+	hdr = (const void *)map;
+	if (len < sizeof(*hdr) || memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) ||
+			hdr->version != SNAPSHOT_VERSION) {
+		mylog(LOG_WARNING, "%s: no valid snapshot", state_file);
+		goto done;
+	}
+	/* find the brokers back by name, the -m order may have changed */
+	bmap = malloc(sizeof(*bmap)*(hdr->nbroker ?: 1));
+	if (!bmap)
+		mylog(LOG_ERR, "malloc %u brokers: %s", hdr->nbroker, ESTR(errno));
+	for (j = 0, pos = SNAPHDR_SIZE; j < hdr->nbroker; ++j, pos += SNAPBROKER_SIZE(sb->namelen)) {
+		sb = (const void *)(map + pos);
+		if (pos + sizeof(*sb) > len || pos + SNAPBROKER_SIZE(sb->namelen) > len) {
+			mylog(LOG_WARNING, "%s: truncated snapshot", state_file);
+			goto done;
+		}
+		for (bmap[j] = NULL, b = brokers; b < brokers+nbrokers; ++b) {
+			if (strlen(b->name) == sb->namelen && !memcmp(b->name, sb+1, sb->namelen)) {
+				bmap[j] = b;
+				break;
+			}
+		}
+	}
+	tnow = wallclock();
+	offset = wallclock_offset();
+	for (j = 0; j < hdr->nrec; ++j, pos += SNAPREC_SIZE(rec->topiclen, resetlen)) {
+		rec = (const void *)(map + pos);
+		resetlen = (pos + sizeof(*rec) <= len && rec->tresetlen > 0) ? rec->tresetlen : 0;
+		if (pos + sizeof(*rec) > len || rec->topiclen <= 0 ||
+				pos + SNAPREC_SIZE(rec->topiclen, resetlen) > len ||
+				rec->state < 0 || rec->state >= sizeof(alrm_states)/sizeof(alrm_states[0]) ||
+				rec->broker < 0 || rec->broker >= hdr->nbroker) {
+			mylog(LOG_WARNING, "%s: truncated snapshot", state_file);
+			break;
+		}
+		if (!bmap[rec->broker]) {
+			/* that broker is not used anymore */
+			++nforeign;
+			continue;
+		}
+		it = get_item(bmap[rec->broker], (const char *)(rec+1), rec->topiclen, 1);
+		if (!it)
+			/* beyond -M */
+			continue;
+		it->maxtime = rec->maxtime;
+		it->hhmm = rec->hhmm;
+		it->wdays = rec->wdays;
+		it->valid = rec->valid;
+		it->snooze_time = rec->snooze_time;
+		it->state = rec->state;
+		it->snap = SNAP_ALL;
+		/* the broker has these values already */
+		it->pubstate = it->state;
+		switch (it->state) {
+		case ALRM_ON:
+			++it->pfx->non;
+			++it->pfx->broker->nalrmon;
+			libt_add_timeout(it->maxtime, on_alrm_done, it);
+			break;
+		case ALRM_SNOOZED:
+			libt_add_timeout(it->snooze_time, on_alrm, it);
+			break;
+		}
+		it->pubnext = rec->scheduled;
+		if (rec->scheduled > tnow)
+			set_scheduled(it, rec->scheduled);
+		else if (rec->scheduled)
+			/* missed while not running */
+			reschedule_alrm(it);
+		if (rec->tresetlen >= 0) {
+			set_timer_reset(it, (const char *)(rec+1) + rec->topiclen, rec->tresetlen);
+			it->tdelay = rec->tdelay;
+			it->tontime = (isnan(rec->tontime) || !rec->tontime) ? rec->tontime : rec->tontime - offset;
+			it->snap |= SNAP_TIMER;
+			/* timeouts that expired while not running fire right away */
+			set_timer(it);
+		}
+	}
+	mylog(LOG_NOTICE, "loaded %u alarms from %s", nitems, state_file);
+	if (nforeign)
+		mylog(LOG_NOTICE, "ignored %u alarms of other brokers", nforeign);
+done:
+	free(bmap);
+	snapshot_unmap(map, len);
+}
+
+/* a message from the retained replay confirms a snapshot value */
+static int snap_unchanged(struct item *it, int flag, int unchanged)
+{
+	int ret = (it->snap & flag) && unchanged;
+
+	it->snap &= ~flag;
+	return ret;
+}
+
+/* alarm commands */
+enum {
+	CMD_NONE,
+	CMD_DISMISS,
+	CMD_SNOOZE,
+	CMD_SKIP,
+	CMD_NOSKIP,
+	CMD_ENABLE,
+	CMD_DISABLE,
+	CMD_FORCE,
+};
+
+static int strntocmd(const char *str, int len)
+{
+	static const char *const cmds[] = {
+		[CMD_DISMISS] = "dismiss",
+		[CMD_SNOOZE] = "snooze",
+		[CMD_SKIP] = "skip",
+		[CMD_NOSKIP] = "noskip",
+		[CMD_ENABLE] = "enable",
+		[CMD_DISABLE] = "disable",
+		[CMD_FORCE] = "force",
+	};
+	int cmd;
+
+	if (!len)
+		return CMD_NONE;
+	switch (*str) {
+	case 'd':
+		cmd = (len == 7 && str[1] == 'i' && str[2] == 's' && str[3] == 'm') ? CMD_DISMISS : CMD_DISABLE;
+		break;
+	case 's':
+		cmd = (len == 4) ? CMD_SKIP : CMD_SNOOZE;
+		break;
+	case 'n':
+		cmd = CMD_NOSKIP;
+		break;
+	case 'e':
+		cmd = CMD_ENABLE;
+		break;
+	case 'f':
+		cmd = CMD_FORCE;
+		break;
+	default:
+		return CMD_NONE;
+	}
+	if (strlen(cmds[cmd]) != len || memcmp(str, cmds[cmd], len))
+		return CMD_NONE;
+	return cmd;
+}
+
+static void alarm_cmd(struct item *it, int cmd, int for_all)
+{
+	switch (cmd) {
+	case CMD_DISMISS:
 		mylog(LOG_INFO, "dismiss '%s'", it->topic);
 		dismiss_alrm(it);
+		break;
 
-	} else if (!strcmp(cmd, "snooze")) {
+	case CMD_SNOOZE:
 		snooze_alrm(it);
+		break;
 
-	} else if (!strcmp(cmd, "skip")) {
+	case CMD_SKIP:
 		if (!it->wdays)
 			/* can't skip non-repeating alarms */
 			return;
@@ -399,129 +1983,274 @@ static void alarm_cmd(struct item *it, const char *cmd, int for_all)
 			it->state = ALRM_SKIP;
 			reschedule_alrm(it);
 		}
+		break;
 
-	} else if (!strcmp(cmd, "noskip")) {
+	case CMD_NOSKIP:
 		if (it->state == ALRM_SKIP) {
 			mylog(LOG_INFO, "noskip request '%s'", it->topic);
 			it->state = ALRM_OFF;
 			reschedule_alrm(it);
 		}
+		break;
 
-	} else if (!strcmp(cmd, "enable")) {
+	case CMD_ENABLE:
 		if ((it->state == ALRM_DISABLED && !for_all) || it->state == ALRM_ALL_DISABLED) {
 			mylog(LOG_INFO, "enabled '%s'", it->topic);
 			it->state = ALRM_OFF;
 			reschedule_alrm(it);
 		}
+		break;
 
-	} else if (!strcmp(cmd, "disable")) {
+	case CMD_DISABLE:
 		if ((it->state != ALRM_DISABLED && !for_all) ||
 				(it->state != ALRM_DISABLED && it->state != ALRM_ALL_DISABLED && for_all)) {
 			mylog(LOG_INFO, "disabled '%s'", it->topic);
 			it->state = for_all ? ALRM_ALL_DISABLED : ALRM_DISABLED;
 			reschedule_alrm(it);
 		}
+		break;
 
-	} else if (!strcmp(cmd, "force")) {
+	case CMD_FORCE:
 		mylog(LOG_INFO, "forced '%s'", it->topic);
 		libt_remove_timeout(on_alrm, it);
-		it->scheduled = 0;
+		set_scheduled(it, 0);
 		it->state = ALRM_ON;
-		pub_alrm_state(it);
+		mark_dirty(it, DIRTY_PUB);
+		break;
 	}
 }
 
-static int strendswith(const char *topic, const char *suffix)
+/* apply a command to all alarms below @topic
+ * Items only get marked dirty, so the settle pass
+ * reschedules & publishes in 1 go
+ */
+static void global_cmd(struct broker *b, const char *topic, int len, int cmd)
 {
-	int slen = strlen(suffix ?: 0);
-	int tlen = strlen(topic ?: 0);
+	struct prefix *pfx;
+	struct item *it;
 
-	if (tlen < slen)
-		return 0;
-	return !strcmp(topic+tlen-slen, suffix);
+	if (cmd == CMD_NONE)
+		return;
+	for (pfx = b->prefixes; pfx; pfx = pfx->next) {
+		/* match 'pre/fix' for 'pre/fix//cmd' and below */
+		if (len && (pfx->topiclen < len || strncmp(pfx->topic, topic, len) ||
+				(pfx->topiclen > len && pfx->topic[len] != '/')))
+			continue;
+		for (it = pfx->items; it; it = it->pnext)
+			alarm_cmd(it, cmd, 1);
+	}
 }
 
-static double strtodelay(const char *str, char **pendp)
-{
-	char *endp;
-	double val;
+/* topic suffixes */
+enum {
+	SUFFIX_NONE,
+	SUFFIX_CMD,
+	SUFFIX_ALARM,
+	SUFFIX_REPEAT,
+	SUFFIX_SNOOZETIME,
+	SUFFIX_MAXTIME,
+	SUFFIX_STATE,
+	SUFFIX_TIMER,
+	SUFFIX_CONDITION,
+	SUFFIX_BULK,
+};
 
-	if (!pendp)
-		pendp = &endp;
+#ifdef WITH_METRICS
+static struct metric m_msgs[] = {
+	[SUFFIX_NONE] = { .name = "msgs.other", },
+	[SUFFIX_CMD] = { .name = "msgs.cmd", },
+	[SUFFIX_ALARM] = { .name = "msgs.alarm", },
+	[SUFFIX_REPEAT] = { .name = "msgs.repeat", },
+	[SUFFIX_SNOOZETIME] = { .name = "msgs.snoozetime", },
+	[SUFFIX_MAXTIME] = { .name = "msgs.maxtime", },
+	[SUFFIX_STATE] = { .name = "msgs.state", },
+	[SUFFIX_TIMER] = { .name = "msgs.timer", },
+	[SUFFIX_CONDITION] = { .name = "msgs.condition", },
+	[SUFFIX_BULK] = { .name = "msgs.bulk", },
+};
+#endif
 
-	val = strtod(str, pendp);
-	switch (**pendp) {
-	case 'w':
-		val *= 7;
-	case 'd':
-		val *= 24;
-	case 'h':
-		val *= 60;
+/* classify the last path element of a topic */
+static int strtosuffix(const char *suffix)
+{
+	switch (*suffix) {
+	case '$':
+		if (!strcmp(suffix, "$bulk"))
+			return SUFFIX_BULK;
+		break;
+	case 'a':
+		if (!strcmp(suffix, "alarm"))
+			return SUFFIX_ALARM;
+		break;
+	case 'c':
+		if (!strcmp(suffix, "cmd"))
+			return SUFFIX_CMD;
+		if (!strcmp(suffix, "condition"))
+			return SUFFIX_CONDITION;
+		break;
 	case 'm':
-		val *= 60;
-		++(*pendp);
+		if (!strcmp(suffix, "maxtime"))
+			return SUFFIX_MAXTIME;
+		break;
+	case 'r':
+		if (!strcmp(suffix, "repeat"))
+			return SUFFIX_REPEAT;
+		break;
+	case 's':
+		if (!strcmp(suffix, "state"))
+			return SUFFIX_STATE;
+		if (!strcmp(suffix, "snoozetime"))
+			return SUFFIX_SNOOZETIME;
 		break;
+	case 't':
+		if (timers && !strcmp(suffix, "timer"))
+			return SUFFIX_TIMER;
+		break;
+	}
+	return SUFFIX_NONE;
+}
+
+/* classify a topic by its last path element, in 1 pass
+ * @plen receives the length of the base topic
+ */
+static int topic_suffix(const char *topic, int *plen)
+{
+	const char *suffix;
+
+	suffix = strrchr(topic, '/');
+	if (!suffix)
+		return SUFFIX_NONE;
+	*plen = suffix++ - topic;
+	return strtosuffix(suffix);
+}
+
+/* find the alarm state, switch on length and first character */
+static int strntostate(const char *str, int len)
+{
+	int val;
+
+	switch (len) {
+	case 2:
+		val = ALRM_ON;
+		break;
+	case 4:
+		val = (*str == 's') ? ALRM_SKIP : ALRM_OFF;
+		break;
+	case 7:
+		val = (*str == 's') ? ALRM_SNOOZED : ALRM_DISABLED;
+		break;
+	case 10:
+		val = ALRM_ALL_DISABLED;
+		break;
+	default:
+		return -1;
 	}
+	if (memcmp(str, alrm_states[val], len))
+		return -1;
 	return val;
 }
 
-static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitto_message *msg)
+/* apply 1 attribute @suffix of the item @topic, @len long
+ * @bulk tells that it comes from PREFIX/$bulk instead of its own topic
+ */
+static void item_attr(struct broker *b, const char *topic, int len, int suffix,
+		const char *payload, int plen, int retain, int bulk)
 {
 	int ret, val;
-	char *endp;
 	struct item *it;
 
-	if (strendswith(msg->topic, "/cmd") && (strlen(msg->topic) >= 5) && msg->topic[strlen(msg->topic)-5] == '/') {
-		/* global ctrl, like 'pre/fix//dismiss' */
-		for (it = items; it; it = it->next)
-			alarm_cmd(it, (const char *)msg->payload, 1);
-
-	} else if ((it = get_item(msg->topic, "/cmd", 0)) != NULL) {
-		alarm_cmd(it, (const char *)msg->payload, 0);
-
-	} else if ((it = get_item(msg->topic, "/alarm", !!msg->payloadlen)) != NULL) {
-		if (!msg->payloadlen) {
-			if (!it)
-				/* is never true */
-				return;
-			/* flush potential MQTT leftovers */
-			mosquitto_publish(mosq, NULL, csprintf("%s/repeat", it->topic),
-					0, NULL, mqtt_qos, 1);
-			mosquitto_publish(mosq, NULL, csprintf("%s/snoozetime", it->topic),
-					0, NULL, mqtt_qos, 1);
-			mosquitto_publish(mosq, NULL, csprintf("%s/maxtime", it->topic),
-					0, NULL, mqtt_qos, 1);
-			mosquitto_publish(mosq, NULL, csprintf("%s/state", it->topic),
-					0, NULL, mqtt_qos, 1);
-			mosquitto_publish(mosq, NULL, it->topic, 0, NULL, mqtt_qos, 1);
-			drop_item(it);
+	switch (suffix) {
+	case SUFFIX_NONE:
+		/* ITEM itself, for its timer */
+		if (timers && (it = get_item(b, topic, len, 0)) != NULL &&
+				it->tresetvalue)
+			timer_value(it, payload, plen);
+		return;
+	case SUFFIX_CMD:
+		if (len > 0 && topic[len-1] == '/') {
+			/* global ctrl, like 'pre/fix//dismiss' */
+			global_cmd(b, topic, len-1, strntocmd(payload, plen));
+			return;
+		}
+		/* only existing items */
+		it = get_item(b, topic, len, 0);
+		break;
+	case SUFFIX_STATE:
+		it = get_item(b, topic, len, retain && plen);
+		/* a broker forwards live publishes without retain flag:
+		 * those are our own echoes, unless another cluster member
+		 * owns the alarm, then it is that owner acting
+		 */
+		if (it && !retain && item_owned(it))
+			return;
+		break;
+	default:
+		it = get_item(b, topic, len, !!plen);
+		break;
+	}
+	if (!it)
+		return;
+	if (suffix != SUFFIX_CMD && suffix != SUFFIX_STATE && suffix != SUFFIX_TIMER)
+		/* where the definition lives, for clear_item() */
+		it->bulk = bulk;
+
+	switch (suffix) {
+	case SUFFIX_CMD:
+		alarm_cmd(it, strntocmd(payload, plen), 0);
+		break;
+
+	case SUFFIX_ALARM:
+		if (!plen) {
+			clear_item(it);
 			return;
 		}
-		ret = strtohhmm(msg->payload ?: "");
+		ret = strntohhmm(payload, plen);
+		if (snap_unchanged(it, SNAP_ALARM, it->valid && ret == it->hhmm))
+			break;
 		if (ret >= 0) {
+			if (!it->valid)
+				/* a dropped orphan may have had attributes */
+				refetch_item(it);
 			it->hhmm = ret;
 			/* mark as valid */
 			it->valid = 1;
 			reschedule_alrm(it);
 		}
-	} else if ((it = get_item(msg->topic, "/repeat", !!msg->payloadlen)) != NULL) {
-		it->wdays = strtowdays(msg->payload ?: "");
+		break;
+
+	case SUFFIX_REPEAT:
+		val = strntowdays(payload, plen);
+		if (snap_unchanged(it, SNAP_REPEAT, val == it->wdays))
+			break;
+		it->wdays = val;
 		reschedule_alrm(it);
+		break;
 
-	} else if ((it = get_item(msg->topic, "/snoozetime", !!msg->payloadlen)) != NULL) {
-		it->snooze_time = strtodelay(msg->payload ?: "10m", &endp);
+	case SUFFIX_SNOOZETIME:
+		it->snap &= ~SNAP_SNOOZETIME;
+		it->snooze_time = plen ? strntodelay(payload, plen, NULL) : 600;
+		want_snapshot();
+		if (summary)
+			mark_dirty(it, DIRTY_SUM);
+		break;
 
-	} else if ((it = get_item(msg->topic, "/maxtime", !!msg->payloadlen)) != NULL) {
-		it->maxtime = strtodelay(msg->payload ?: "1h", &endp);
+	case SUFFIX_MAXTIME:
+		it->snap &= ~SNAP_MAXTIME;
+		it->maxtime = plen ? strntodelay(payload, plen, NULL) : 3600;
+		want_snapshot();
+		if (summary)
+			mark_dirty(it, DIRTY_SUM);
+		break;
 
-	} else if (msg->retain && (it = get_item(msg->topic, "/state", !!msg->payloadlen)) != NULL) {
-		for (val = 0; val < sizeof(alrm_states)/sizeof(alrm_states[0]); ++val) {
-			if (!strcmp(msg->payload, alrm_states[val]))
-				break;
-		}
-		if (val >= sizeof(alrm_states)/sizeof(alrm_states[0]))
+	case SUFFIX_STATE:
+		val = strntostate(payload, plen);
+		if (val < 0)
 			/* bad state supplied */
 			return;
+		/* the owner acted */
+		it->missed = NULL;
+		if (snap_unchanged(it, SNAP_STATE, val == it->state))
+			break;
 		mylog(LOG_INFO, "new state %s = '%s'", it->topic, alrm_states[val]);
 		it->state = val;
 		switch (val) {
@@ -531,49 +2260,481 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 			break;
 		case ALRM_ON:
 			libt_remove_timeout(on_alrm, it);
-			it->scheduled = 0;
+			set_scheduled(it, 0);
 			break;
 		case ALRM_SNOOZED:
 			if (!it->snooze_time) {
-				mylog(LOG_INFO, "%s snoozed, with snooze-time 0!", msg->topic);
+				mylog(LOG_INFO, "%s snoozed, with snooze-time 0!", it->topic);
 				dismiss_alrm(it);
 				break;
 			}
 			libt_add_timeout(it->snooze_time, on_alrm, it);
-			it->scheduled = 0;
+			set_scheduled(it, 0);
 			break;
 		case ALRM_DISABLED:
 		case ALRM_ALL_DISABLED:
 			reschedule_alrm(it);
 			break;
 		}
-		pub_alrm_state(it);
+		mark_dirty(it, DIRTY_PUB);
+		break;
+
+	case SUFFIX_TIMER:
+		it->snap &= ~SNAP_TIMER;
+		if (!plen) {
+			mylog(LOG_INFO, "removed timer spec for %s", it->topic);
+			drop_timer(it);
+			if (!it->valid)
+				/* nothing left */
+				drop_item(it);
+			break;
+		}
+		timer_spec(it, payload, plen);
+		break;
+
+	case SUFFIX_CONDITION:
+		set_cond(it, payload, plen);
+		break;
+	}
+}
+
+/* PREFIX/$bulk defines many alarms in 1 message, 1 line (or ;) per alarm:
+ *	NAME ATTR=VALUE ...	set attributes, like PREFIX/NAME/ATTR does
+ *	-NAME			remove the alarm
+ * A VALUE with spaces goes in "", an empty VALUE is an empty payload.
+ * Lines starting with # are skipped.
+ * The whole message is checked before applying it, 1 bad line rejects all,
+ * and its reschedules go in 1 settle pass.
+ * @topic holds PREFIX/, with room for the longest NAME
+ * returns the number of alarms, or -LINENO
+ */
+static int bulk_apply(struct broker *b, char *topic, int pfxlen,
+		const char *payload, int plen, int apply)
+{
+	const char *str, *eol, *end, *name, *attr, *val, *nl = NULL;
+	int n = 0, lineno = 0, namelen, vallen, suffix;
+	char attrname[16];
+
+	for (str = payload, end = payload+plen; str < end; str = eol+1) {
+		if (str > nl) {
+			/* the ; entries of 1 line share its end */
+			nl = memchr(str, '\n', end-str) ?: end;
+			++lineno;
+		}
+		eol = memchr(str, ';', nl-str) ?: nl;
+		for (; str < eol && strchr(" \t\r", *str); ++str);
+		if (str >= eol || *str == '#')
+			continue;
+
+		/* NAME */
+		attr = (*str == '-') ? str+1 : str;
+		for (name = attr; attr < eol && !strchr(" \t\r", *attr); ++attr);
+		namelen = attr - name;
+		if (!namelen || memchr(name, '/', namelen) || memchr(name, '+', namelen) ||
+				memchr(name, '#', namelen))
+			return -lineno;
+		memcpy(topic+pfxlen+1, name, namelen);
+		topic[pfxlen+1+namelen] = 0;
+		++n;
+		if (*str == '-') {
+			for (; attr < eol && strchr(" \t\r", *attr); ++attr);
+			if (attr < eol)
+				return -lineno;
+			if (apply)
+				item_attr(b, topic, pfxlen+1+namelen, SUFFIX_ALARM, NULL, 0, 1, 1);
+			continue;
+		}
+
+		/* ATTR=VALUE ... */
+		for (;;) {
+			for (; attr < eol && strchr(" \t\r", *attr); ++attr);
+			if (attr >= eol)
+				break;
+			for (val = attr; val < eol && *val != '=' && !strchr(" \t\r", *val); ++val);
+			if (val >= eol || *val != '=' || val == attr || val - attr >= sizeof(attrname))
+				return -lineno;
+			memcpy(attrname, attr, val - attr);
+			attrname[val - attr] = 0;
+			suffix = strtosuffix(attrname);
+			if (*++val == '"') {
+				++val;
+				attr = memchr(val, '"', eol-val);
+				if (!attr)
+					return -lineno;
+				vallen = attr++ - val;
+			} else {
+				for (attr = val; attr < eol && !strchr(" \t\r", *attr); ++attr);
+				vallen = attr - val;
+			}
+			if (suffix == SUFFIX_NONE && !strcmp(attrname, "timer"))
+				/* the timers are for mqttimer, without -t */
+				continue;
+			if (suffix == SUFFIX_NONE || suffix == SUFFIX_BULK ||
+					(suffix == SUFFIX_ALARM && vallen &&
+					 strntohhmm(val, vallen) < 0))
+				return -lineno;
+			if (apply)
+				item_attr(b, topic, pfxlen+1+namelen, suffix, val, vallen, 1, 1);
+		}
+	}
+	return n;
+}
+
+static void bulk_msg(struct broker *b, const char *topic, int len, const char *payload, int plen)
+{
+	char *buf;
+	int ret;
+
+	buf = malloc(len+plen+2);
+	if (!buf)
+		mylog(LOG_ERR, "malloc bulk: %s", ESTR(errno));
+	memcpy(buf, topic, len);
+	buf[len] = '/';
+	ret = bulk_apply(b, buf, len, payload, plen, 0);
+	if (ret < 0)
+		mylog(LOG_WARNING, "%s:%i: bad line, bulk ignored", topic, -ret);
+	else {
+		bulk_apply(b, buf, len, payload, plen, 1);
+		metric_add(&m_bulkalarms, ret);
+		mylog(LOG_INFO, "%s: %i alarms", topic, ret);
+	}
+	free(buf);
+}
+
+static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitto_message *msg)
+{
+	struct broker *b = dat;
+	int len, suffix;
+
+	/* keep track of the values we publish */
+	pubq_select(b->pubq);
+	pubq_seen(msg->topic, msg->payload, msg->payloadlen);
+	if (cluster_msg(mosq, msg->topic, msg->payload, msg->payloadlen, mqtt_qos))
+		return;
+	/* a topic may be both an input of conditions and an alarm topic */
+	if (ndeps)
+		dep_value(b, msg->topic, msg->payload, msg->payloadlen);
+
+	suffix = topic_suffix(msg->topic, &len);
+	metric_inc(&m_msgs[suffix]);
+	if (suffix == SUFFIX_NONE)
+		len = strlen(msg->topic);
+	else if (suffix == SUFFIX_BULK) {
+		bulk_msg(b, msg->topic, len, msg->payload, msg->payloadlen);
+		return;
 	}
+	item_attr(b, msg->topic, len, suffix, msg->payload, msg->payloadlen, msg->retain, 0);
 }
 
 static void my_exit(void)
 {
-	if (mosq)
-		mosquitto_disconnect(mosq);
+	struct broker *b;
+
+	if (snapshot_pending)
+		save_snapshot(NULL);
+	for (b = brokers; b < brokers+nbrokers; ++b) {
+		if (!b->mosq)
+			continue;
+		if (cluster_group)
+			/* hand over our alarms right away */
+			cluster_leave(b->mosq, mqtt_qos);
+		mosquitto_disconnect(b->mosq);
+	}
 }
 
-static void do_mqtt_maintenance(void *dat)
+/* cluster membership changed, take over what the previous owner left */
+static void cluster_changed(void)
+{
+	struct item *it;
+	struct broker *b;
+	struct prefix *pfx;
+	void (*fn)(void *);
+
+	for (it = items; it; it = it->next) {
+		if (it->missed && item_owned(it)) {
+			fn = it->missed;
+			it->missed = NULL;
+			fn(it);
+		}
+		if (it->tmissed && item_owned(it))
+			on_timer(it);
+	}
+	/* a new leader publishes the counters */
+	for (b = brokers; b < brokers+nbrokers; ++b) {
+		b->pubnalrmon = -1;
+		for (pfx = b->prefixes; pfx; pfx = pfx->next) {
+			pfx->pubnon = -1;
+			if (summary)
+				want_summary(pfx);
+		}
+	}
+	want_settle();
+}
+
+static void subscribe_patterns(struct broker *b)
 {
 	int ret;
 
-	ret = mosquitto_loop_misc(dat);
+	/* all patterns in 1 SUBSCRIBE */
+	ret = mosquitto_subscribe_multiple(b->mosq, &b->patmid, mqtt_npatterns, mqtt_patterns, mqtt_qos, 0, NULL);
 	if (ret)
-		mylog(LOG_ERR, "mosquitto_loop_misc: %s", mosquitto_strerror(ret));
-	libt_add_timeout(1, do_mqtt_maintenance, dat);
+		mylog(LOG_WARNING, "mosquitto_subscribe %s %u patterns: %s", b->name, mqtt_npatterns, mosquitto_strerror(ret));
 }
 
-int main(int argc, char *argv[])
+static void my_mqtt_subscribe(struct mosquitto *mosq, void *dat, int mid, int qos_count, const int *granted_qos)
+{
+	struct broker *b = dat;
+
+	if (mid != b->patmid || b->subacked)
+		return;
+	b->subacked = 1;
+	if (state_file)
+		/* the retained replay follows now, give it time to confirm the snapshot */
+		libt_add_timeout(SNAPSHOT_GRACE, expire_snapshot, b);
+}
+
+static void my_mqtt_connect(struct mosquitto *mosq, void *dat, int rc, int flags)
 {
-	int opt, ret;
+	struct broker *b = dat;
+
+	if (rc) {
+		mylog(LOG_WARNING, "connect %s refused: %s", b->name, mosquitto_connack_string(rc));
+		return;
+	}
+	/* the broker remembers our subscriptions when it kept the session */
+	if (!b->connected_once || !(flags & 1)) {
+		subscribe_patterns(b);
+		subscribe_deps(b);
+	}
+	if (cluster_group)
+		/* the will may have removed our lease */
+		cluster_join(mosq, mqtt_qos);
+	if (b->connected_once)
+		mylog(LOG_NOTICE, "reconnected to %s%s", b->name, (flags & 1) ? "" : ", new session");
+	b->connected_once = 1;
+	b->reconnect_delay = 0;
+}
+
+static void my_mqtt_connect_v5(struct mosquitto *mosq, void *dat, int rc, int flags, const mosquitto_property *props)
+{
+	uint16_t aliasmax = 0;
+
+	if (!rc) {
+		/* the broker tells how many aliases it accepts, none when absent */
+		mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &aliasmax, false);
+		pubq_select(((struct broker *)dat)->pubq);
+		pubq_set_v5(aliasmax);
+	}
+	my_mqtt_connect(mosq, dat, rc, flags);
+}
+
+/* return the delay for the next reconnect attempt, and increase it */
+static double reconnect_backoff(struct broker *b)
+{
+	double delay = b->reconnect_delay;
+
+	b->reconnect_delay = delay ? delay*2 : RECONNECT_MIN;
+	if (b->reconnect_delay > RECONNECT_MAX)
+		b->reconnect_delay = RECONNECT_MAX;
+	return delay;
+}
+
+static void do_mqtt_maintenance(void *dat);
+
+static void do_mqtt_reconnect(void *dat)
+{
+	struct broker *b = dat;
+	int ret;
+	double delay;
+
+	ret = mosquitto_reconnect(b->mosq);
+	if (ret) {
+		delay = reconnect_backoff(b);
+		mylog(LOG_INFO, "mosquitto_reconnect %s: %s, retry in %.0lfs", b->name, mosquitto_strerror(ret), delay);
+		libt_add_timeout(delay, do_mqtt_reconnect, b);
+		return;
+	}
+	b->connected = 1;
+	libt_add_timeout(0, do_mqtt_maintenance, b);
+}
+
+/* the connection broke, alarms keep running while reconnecting */
+static void mqtt_lost(struct broker *b, const char *what, int ret)
+{
+	if (!b->connected)
+		return;
+	mylog(LOG_WARNING, "%s %s: %s, reconnecting", what, b->name, mosquitto_strerror(ret));
+	b->connected = 0;
+	/* the new socket may reuse the fd number, drop the old one now */
+	if (b->sockfd >= 0)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, b->sockfd, NULL);
+	b->sockfd = -1;
+	libt_add_timeout(reconnect_backoff(b), do_mqtt_reconnect, b);
+}
+
+static void add_broker(const char *host)
+{
+	struct broker *b;
 	char *str;
-	char mqtt_name[32];
+
+	brokers = realloc(brokers, sizeof(*brokers)*(nbrokers+1));
+	if (!brokers)
+		mylog(LOG_ERR, "realloc %u brokers: %s", nbrokers+1, ESTR(errno));
+	b = brokers+nbrokers;
+	memset(b, 0, sizeof(*b));
+	b->idx = nbrokers++;
+	b->host = strdup(host);
+	b->port = 1883;
+	str = strrchr(b->host, ':');
+	if (str > b->host && *(str-1) != ']') {
+		/* TCP port provided */
+		*str = 0;
+		b->port = strtoul(str+1, NULL, 10);
+	}
+	asprintf(&b->name, "%s:%i", b->host, b->port);
+	b->sockfd = -1;
+	b->pubnalrmon = -1;
+	/* the first broker keeps the default queue, for the metrics */
+	if (b->idx)
+		b->pubq = pubq_new();
+}
+
+static void start_broker(struct broker *b)
+{
+	int ret;
+
+	b->mosq = mosquitto_new(mqtt_id, false, b);
+	if (!b->mosq)
+		mylog(LOG_ERR, "mosquitto_new failed: %s", ESTR(errno));
+	if (cluster_group) {
+		/* the broker drops our lease when we vanish */
+		ret = mosquitto_will_set(b->mosq, cluster_topic(), 0, NULL, mqtt_qos, 1);
+		if (ret)
+			mylog(LOG_ERR, "mosquitto_will_set: %s", mosquitto_strerror(ret));
+	}
+
+	mosquitto_log_callback_set(b->mosq, my_mqtt_log);
+	mosquitto_message_callback_set(b->mosq, my_mqtt_msg);
+	mosquitto_subscribe_callback_set(b->mosq, my_mqtt_subscribe);
+	if (mqtt_v5) {
+		ret = mosquitto_int_option(b->mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+		if (ret)
+			mylog(LOG_ERR, "mosquitto_int_option v5: %s", mosquitto_strerror(ret));
+		mosquitto_connect_v5_callback_set(b->mosq, my_mqtt_connect_v5);
+	} else
+		mosquitto_connect_with_flags_callback_set(b->mosq, my_mqtt_connect);
+
+	ret = mosquitto_connect(b->mosq, b->host, b->port, mqtt_keepalive);
+	if (ret)
+		mylog(LOG_ERR, "mosquitto_connect %s: %s", b->name, mosquitto_strerror(ret));
+	b->connected = 1;
+}
+
+/* send what was produced during the last pass,
+ * keep it queued while disconnected
+ */
+static void flush_broker(struct broker *b)
+{
+	struct epoll_event ev;
+	int ret, fd;
+
+	pubq_select(b->pubq);
+	if (b->connected && pubq_flush(b->mosq, mqtt_qos) < 0)
+		mqtt_lost(b, "mosquitto_publish", MOSQ_ERR_NO_CONN);
+	if (b->connected && mosquitto_want_write(b->mosq)) {
+		ret = mosquitto_loop_write(b->mosq, 1);
+		if (ret)
+			mqtt_lost(b, "mosquitto_loop_write", ret);
+	}
+	/* the socket changes on reconnect */
+	fd = b->connected ? mosquitto_socket(b->mosq) : -1;
+	if (fd == b->sockfd)
+		return;
+	if (b->sockfd >= 0)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, b->sockfd, NULL);
+	b->sockfd = fd;
+	if (fd < 0)
+		return;
+	ev.events = EPOLLIN;
+	ev.data.ptr = b;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		mylog(LOG_ERR, "epoll_ctl %s: %s", b->name, ESTR(errno));
+}
+
+/* libmosquitto pings once the connection was silent in either direction
+ * for the keepalive, counting whole seconds, so wake up 1s later.
+ * The socket tells when that is.
+ */
+static void do_mqtt_maintenance(void *dat)
+{
+	struct broker *b = dat;
+	double idle;
+	int ret;
+
+	if (!b->connected)
+		/* the reconnect restarts it */
+		return;
+	idle = sock_idle(mosquitto_socket(b->mosq));
+	if (idle >= 0 && idle < mqtt_keepalive + 1) {
+		libt_add_timeout(mqtt_keepalive + 1 - idle, do_mqtt_maintenance, dat);
+		return;
+	}
+	ret = mosquitto_loop_misc(b->mosq);
+	if (ret) {
+		mqtt_lost(b, "mosquitto_loop_misc", ret);
+		return;
+	}
+	/* the PINGRESP is due within keepalive,
+	 * without socket info, run a few times per interval
+	 */
+	libt_add_timeout((idle < 0) ? mqtt_keepalive / 4.0 : mqtt_keepalive + 1, do_mqtt_maintenance, dat);
+}
+
+/* the main loop for a replay
+ * The simulated clock jumps from event to event,
+ * the timerfd is replaced by testing tfd_setp.
+ */
+static void replay_loop(void)
+{
+	struct broker *b = brokers;
+	int ret;
+
+	for (;;) {
+		libt_flush();
+		metrics_poll();
+		pubq_select(b->pubq);
+		pubq_flush_to(replay_pub);
+		if (settle_pending) {
+			/* the messages of 1 instant are 1 burst */
+			settle_items(NULL);
+			continue;
+		}
+		logq_flush();
+		ret = replay_step(tfd_setp, my_mqtt_msg, b);
+		if (ret < 0)
+			break;
+		if (ret > 0) {
+			time_changed();
+			tfd_setp = -1;
+			arm_timerfd();
+		} else if (tfd_setp > 0 && tfd_setp <= wallclock())
+			raise_due(tfd_setp);
+	}
+	/* publish what the end produced */
+	pubq_flush_to(replay_pub);
+	fflush(stdout);
+}
+
+/* events per epoll_wait */
+#define NEVENTS	64
+
+int main(int argc, char *argv[])
+{
+	int opt, ret, j, nev, tfd_ready;
+	char mqtt_name[80];
 	int logmask = LOG_UPTO(LOG_NOTICE);
-	struct item *it;
+	struct broker *b;
+	struct epoll_event ev, evs[NEVENTS];
 
 	/* argument parsing */
 	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) >= 0)
@@ -593,13 +2754,46 @@ int main(int argc, char *argv[])
 		}
 		break;
 	case 'm':
-		mqtt_host = optarg;
-		str = strrchr(optarg, ':');
-		if (str > mqtt_host && *(str-1) != ']') {
-			/* TCP port provided */
-			*str = 0;
-			mqtt_port = strtoul(str+1, NULL, 10);
-		}
+		add_broker(optarg);
+		break;
+	case 'i':
+		mqtt_id = optarg;
+		break;
+	case '5':
+		mqtt_v5 = 1;
+		break;
+	case 'P':
+		mqtt_state_prop = 1;
+		break;
+	case 'c':
+		count_prefix = 1;
+		break;
+	case 'f':
+		state_file = optarg;
+		break;
+	case 'C':
+		cluster_group = optarg;
+		break;
+	case 'S':
+		summary = 1;
+		break;
+	case 't':
+		timers = 1;
+		break;
+	case 'M':
+		max_items = strtoul(optarg, NULL, 0);
+		break;
+	case 'R':
+		replay_file = optarg;
+		break;
+	case 'p':
+		precise = 1;
+		break;
+	case 'a':
+		coalesce = strntodelay(optarg, strlen(optarg), NULL);
+		break;
+	case 'l':
+		slack = strntodelay(optarg, strlen(optarg), NULL);
 		break;
 
 	default:
@@ -609,88 +2803,146 @@ int main(int argc, char *argv[])
 		exit(1);
 		break;
 	}
+	if (mqtt_state_prop && !mqtt_v5) {
+		fputs("-P requires -5\n", stderr);
+		exit(1);
+	}
+	if (!nbrokers)
+		add_broker("localhost");
+	if (cluster_group && nbrokers > 1) {
+		/* the cluster leases live on 1 broker */
+		fputs("-C requires a single -m\n", stderr);
+		exit(1);
+	}
+	if (replay_file && nbrokers > 1) {
+		/* with -C, the trace holds the cluster leases */
+		fputs("-R works for 1 broker\n", stderr);
+		exit(1);
+	}
+
+	if (precise && (coalesce > 0 || slack > 0)) {
+		fputs("-p works without -a and -l\n", stderr);
+		exit(1);
+	}
 
 	atexit(my_exit);
 	openlog(NAME, LOG_PERROR, LOG_LOCAL2);
 	setlogmask(logmask);
+	if (precise)
+		tsource_precise();
+	tsource_coalesce(coalesce);
+	if (slack > 0)
+		tsource_slack(slack);
+	if (replay_file)
+		/* before any timeout, the clock changes */
+		replay_init(replay_file);
 
 	/* MQTT start */
 	mosquitto_lib_init();
-	sprintf(mqtt_name, "%s-%i", NAME, getpid());
-	mosq = mosquitto_new(mqtt_name, true, 0);
-	if (!mosq)
-		mylog(LOG_ERR, "mosquitto_new failed: %s", ESTR(errno));
-	/* mosquitto_will_set(mosq, "TOPIC", 0, NULL, mqtt_qos, 1); */
-
-	mosquitto_log_callback_set(mosq, my_mqtt_log);
-	mosquitto_message_callback_set(mosq, my_mqtt_msg);
-
-	ret = mosquitto_connect(mosq, mqtt_host, mqtt_port, mqtt_keepalive);
-	if (ret)
-		mylog(LOG_ERR, "mosquitto_connect %s:%i: %s", mqtt_host, mqtt_port, mosquitto_strerror(ret));
-
-	/* SUBSCRIBE */
-	if (optind >= argc) {
-		ret = mosquitto_subscribe(mosq, NULL, "alarms/+/+", mqtt_qos);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_subscribe 'alarms/+/+': %s", mosquitto_strerror(ret));
-		/* re-assign the default */
-	} else for (; optind < argc; ++optind) {
-		ret = mosquitto_subscribe(mosq, NULL, argv[optind], mqtt_qos);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_subscribe %s: %s", argv[optind], mosquitto_strerror(ret));
+	if (!mqtt_id) {
+		/* a stable id, so the broker keeps our session */
+		strcpy(mqtt_name, NAME "-");
+		gethostname(mqtt_name+strlen(mqtt_name), sizeof(mqtt_name)-strlen(mqtt_name)-1);
+		mqtt_name[sizeof(mqtt_name)-1] = 0;
+		mqtt_id = mqtt_name;
+	}
+	if (cluster_group)
+		cluster_init(cluster_group, mqtt_id, cluster_changed);
+	for (b = brokers; b < brokers+nbrokers && !replay_file; ++b)
+		start_broker(b);
+
+	/* SUBSCRIBE, when connected */
+	mqtt_npatterns = (optind < argc) ? argc-optind : 1;
+	mqtt_patterns = malloc(sizeof(*mqtt_patterns)*(mqtt_npatterns+2));
+	if (!mqtt_patterns)
+		mylog(LOG_ERR, "malloc patterns: %s", ESTR(errno));
+	if (optind < argc)
+		memcpy(mqtt_patterns, argv+optind, sizeof(*mqtt_patterns)*mqtt_npatterns);
+	else {
+		mqtt_patterns[0] = "alarms/+/+";
+		if (timers)
+			/* the timers watch ITEM itself, and alarms/$bulk */
+			mqtt_patterns[mqtt_npatterns++] = "alarms/+";
+		else
+			mqtt_patterns[mqtt_npatterns++] = "alarms/$bulk";
+	}
+	if (cluster_group)
+		mqtt_patterns[mqtt_npatterns++] = (char *)cluster_pattern();
+
+	/* all sockets and the timerfd in 1 epoll set
+	 * The brokers register their socket once connected.
+	 */
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		mylog(LOG_ERR, "epoll_create: %s", ESTR(errno));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, tsource_init(), &ev) < 0)
+		mylog(LOG_ERR, "epoll_ctl timerfd: %s", ESTR(errno));
+
+	if (state_file) {
+		/* warm start, the retained replay becomes a diff */
+		load_snapshot();
+		arm_timerfd();
+		if (replay_file)
+			/* the trace starts with the retained replay */
+			libt_add_timeout(SNAPSHOT_GRACE, expire_snapshot, brokers);
 	}
 
-	/* timerfd */
-	tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK);
-	if (tfd < 0)
-		mylog(LOG_ERR, "timerfd_create: %s", ESTR(errno));
+	libt_add_timeout(ORPHAN_SWEEP, sweep_orphans, NULL);
+	if (replay_file) {
+		metrics_init(NAME);
+		replay_loop();
+		return 0;
+	}
 
 	/* loop */
-	libt_add_timeout(0, do_mqtt_maintenance, mosq);
-	struct pollfd pf[2] = {
-		[0] = { .fd = mosquitto_socket(mosq), .events = POLL_IN, },
-		[1] = { .fd = tfd, .events = POLL_IN, },
-	};
+	for (b = brokers; b < brokers+nbrokers; ++b)
+		libt_add_timeout(0, do_mqtt_maintenance, b);
+	metrics_init(NAME);
 	while (1) {
 		libt_flush();
-		if (mosquitto_want_write(mosq)) {
-			ret = mosquitto_loop_write(mosq, 1);
-			if (ret)
-				mylog(LOG_ERR, "mosquitto_loop_write: %s", mosquitto_strerror(ret));
-		}
-		ret = poll(pf, 2, libt_get_waittime());
-		if (ret < 0 && errno == EINTR)
+		metrics_poll();
+		for (b = brokers; b < brokers+nbrokers; ++b)
+			flush_broker(b);
+		if (!settle_pending)
+			/* idle, write the log */
+			logq_flush();
+		/* don't wait when work is pending,
+		 * the timerfd wakes us for the alarms and the timeouts
+		 */
+		tsource_arm();
+		nev = epoll_wait(epfd, evs, NEVENTS, settle_pending ? 0 : -1);
+		if (nev < 0 && errno == EINTR)
+			continue;
+		if (nev < 0)
+			mylog(LOG_ERR, "epoll_wait: %s", ESTR(errno));
+		if (!nev && settle_pending) {
+			/* incoming messages are drained */
+			settle_items(NULL);
 			continue;
-		if (ret < 0)
-			mylog(LOG_ERR, "poll ...");
-		if (pf[0].revents) {
-			/* mqtt read ... */
-			ret = mosquitto_loop_read(mosq, 1);
-			if (ret) {
-				mylog(LOG_WARNING, "mosquitto_loop_read: %s", mosquitto_strerror(ret));
-				break;
-			}
 		}
-		if (pf[1].revents) {
-			uint64_t tfd_val;
-			time_t saved_setp = tfd_setp;
-
-			ret = read(tfd, &tfd_val, sizeof(tfd_val));
-			if (ret < 0 && errno == EINTR)
+		tfd_ready = 0;
+		for (j = 0; j < nev; ++j) {
+			b = evs[j].data.ptr;
+			if (!b) {
+				/* timerfd, after the messages */
+				tfd_ready = 1;
 				continue;
-			else if (ret < 0 && errno == ECANCELED)
-				time_changed();
-			else if (ret < 0)
-				mylog(LOG_ERR, "read timerfd: %s", ESTR(errno));
-
-			else for (it = items; it; it = it->next) {
-				if (saved_setp && it->scheduled && it->scheduled <= saved_setp)
-					/* this alarm should fire now */
-					on_alrm(it);
 			}
-			/* re-arm */
-			arm_timerfd();
+			/* mqtt read ... */
+			ret = mosquitto_loop_read(b->mosq, 1);
+			if (ret)
+				mqtt_lost(b, "mosquitto_loop_read", ret);
+		}
+		if (tfd_ready) {
+			ret = tsource_read();
+			if (ret & TSOURCE_CHANGED) {
+				time_changed();
+				tfd_setp = -1;
+				arm_timerfd();
+			} else if (ret & TSOURCE_DUE)
+				raise_due(tfd_setp);
 		}
 	}
 	return 0;
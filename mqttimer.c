@@ -12,22 +12,36 @@
 
 #include <unistd.h>
 #include <getopt.h>
+#include <poll.h>
 #include <syslog.h>
 #include <mosquitto.h>
 
 #include "lib/libt.h"
+#include "common.h"
+#include "pubq.h"
+#include "cluster.h"
+#include "metrics.h"
+#include "alloc.h"
+#include "replay.h"
+#include "tsource.h"
+#include "logq.h"
 
 #define NAME "mqttimer"
 #ifndef VERSION
 #define VERSION "<undefined version>"
 #endif
 
-/* generic error logging */
+/* generic error logging, via the log queue
+ * Errors are written right away, after what is queued.
+ */
 #define mylog(loglevel, fmt, ...) \
 	({\
-		syslog(loglevel, fmt, ##__VA_ARGS__); \
-		if (loglevel <= LOG_ERR)\
+		if (loglevel <= LOG_ERR) {\
+			logq_flush();\
+			syslog(loglevel, fmt, ##__VA_ARGS__); \
 			exit(1);\
+		}\
+		logq_add(loglevel, fmt, ##__VA_ARGS__); \
 	})
 #define ESTR(num)	strerror(num)
 
@@ -40,9 +54,19 @@ static const char help_msg[] =
 	" -V, --version		Show version\n"
 	" -v, --verbose		Be more verbose\n"
 	" -m, --mqtt=HOST[:PORT]Specify alternate MQTT host+port\n"
+	" -i, --id=NAME		MQTT client id for the persistent session (default " NAME "-HOSTNAME)\n"
 	" -r, --reset=STR	The global 'default' reset value (default '0')\n"
 	" -s, --suffix=STR	Give MQTT topic suffix for timeouts (default '/timer')\n"
 	" -w, --write=STR	Give MQTT topic suffix for writing the topic (default empty)\n"
+	" -N, --nosubscribe	Don't subscribe to each timer topic, rely on PATTERN\n"
+	" -f, --state-file=FILE	Keep a snapshot of all timers in FILE, for a warm start\n"
+	" -C, --cluster=GROUP	Share the timers with the other instances of GROUP\n"
+	" -R, --replay=FILE	Replay the MQTT trace FILE on a simulated clock, without broker,\n"
+	"			and write the publishes to stdout\n"
+	" -p, --precise		Wake up with sub-msec precision and the lowest timer slack\n"
+	" -a, --coalesce=SECS	Wake up on multiples of SECS only, to sleep longer\n"
+	" -l, --slack=SECS	Delay a wakeup up to SECS to share it with another deadline,\n"
+	"			this is the timer slack of the process too\n"
 	"\n"
 	"Paramteres\n"
 	" PATTERN	A pattern to subscribe for\n"
@@ -55,9 +79,17 @@ static struct option long_opts[] = {
 	{ "verbose", no_argument, NULL, 'v', },
 
 	{ "mqtt", required_argument, NULL, 'm', },
+	{ "id", required_argument, NULL, 'i', },
 	{ "reset", required_argument, NULL, 'r', },
 	{ "suffix", required_argument, NULL, 's', },
 	{ "write", required_argument, NULL, 'w', },
+	{ "nosubscribe", no_argument, NULL, 'N', },
+	{ "state-file", required_argument, NULL, 'f', },
+	{ "cluster", required_argument, NULL, 'C', },
+	{ "replay", required_argument, NULL, 'R', },
+	{ "precise", no_argument, NULL, 'p', },
+	{ "coalesce", required_argument, NULL, 'a', },
+	{ "slack", required_argument, NULL, 'l', },
 
 	{ },
 };
@@ -65,7 +97,7 @@ static struct option long_opts[] = {
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "Vv?m:r:s:w:";
+static const char optstring[] = "Vv?m:i:r:s:w:Nf:C:R:pa:l:";
 
 /* signal handler */
 static volatile int sigterm;
@@ -75,27 +107,93 @@ static const char *mqtt_host = "localhost";
 static int mqtt_port = 1883;
 static const char *mqtt_suffix = "/timer";
 static const char *mqtt_write_suffix;
+static int mqtt_write_suffixlen;
 static const char *mqtt_reset_value = "0";
 static int mqtt_suffixlen = 6;
 static int mqtt_keepalive = 10;
 static int mqtt_qos = 1;
+static int mqtt_subscribe_items = 1;
+static const char *mqtt_id;
+/* subscription patterns, renewed on reconnect */
+static char **mqtt_patterns;
+static int mqtt_npatterns;
+static const char *state_file;
+static const char *cluster_group;
+static const char *replay_file;
+/* timer source */
+static int precise;
+static double coalesce, slack;
 
 /* state */
 static struct mosquitto *mosq;
+static int mqtt_connected;
+static double reconnect_delay;
+/* reconnect backoff */
+#define RECONNECT_MIN	1.0
+#define RECONNECT_MAX	60.0
 
 struct item {
-	struct item *next;
-	struct item *prev;
+	/* @prev points to the pointer that points to us */
+	struct item *next, **prev;
+	/* hash table collision chain */
+	struct item *hnext;
+	unsigned int hash;
 
+	/* with room to append the write suffix in place */
 	char *topic;
 	int topiclen;
-	char *writetopic;
+	/* position in subq, +1 */
+	int subidx;
+	int subscribed;
+	/* reset value, short values are stored inline */
 	char *resetvalue;
+	int resetlen;
+	char resetbuf[16];
 	double delay;
 	double ontime;
+	/* loaded from snapshot, spec not yet confirmed by MQTT */
+	int snap;
+	/* timeout expired while another cluster member owned this timer */
+	int missed;
 };
 
 struct item *items;
+static struct slab item_slab = SLAB_INIT(struct item);
+/* topics and long reset values */
+static struct arena strings;
+
+/* hash table of items, indexed by base topic */
+static struct item **htab;
+static int htabsize;
+static int nitems;
+
+/* pending (un)subscriptions, sent in batch */
+static struct item **subq;
+static int nsubq, ssubq;
+static char **unsubq;
+static int nunsubq, sunsubq;
+METRIC(m_items, "items");
+METRIC(m_msgs_spec, "msgs.spec");
+METRIC(m_msgs_value, "msgs.value");
+METRIC(m_resetlag, "reset.lag");
+
+/* max topics per SUBSCRIBE packet */
+#define SUBQ_BATCH	128
+
+/* snapshot writes are delayed, to combine changes */
+#define SNAPSHOT_DELAY	5.0
+/* time for the retained replay to confirm snapshot items */
+#define SNAPSHOT_GRACE	10.0
+static int snapshot_pending;
+static void save_snapshot(void *dat);
+
+static void want_snapshot(void)
+{
+	if (!state_file || snapshot_pending)
+		return;
+	libt_add_timeout(SNAPSHOT_DELAY, save_snapshot, NULL);
+	snapshot_pending = 1;
+}
 
 /* MQTT iface */
 static void my_mqtt_log(struct mosquitto *mosq, void *userdata, int level, const char *str)
@@ -118,94 +216,350 @@ static void my_mqtt_log(struct mosquitto *mosq, void *userdata, int level, const
 	}
 }
 
-static struct item *get_item(const char *topic, const char *suffix, int create)
+static void htab_grow(void)
 {
 	struct item *it;
-	int len, ret;
+	int newsize = htabsize ? htabsize*2 : 64;
+
+	free(htab);
+	htab = malloc(sizeof(*htab)*newsize);
+	if (!htab)
+		mylog(LOG_ERR, "malloc %u items: %s", newsize, ESTR(errno));
+	memset(htab, 0, sizeof(*htab)*newsize);
+	htabsize = newsize;
+	/* rehash */
+	for (it = items; it; it = it->next) {
+		it->hnext = htab[it->hash & (htabsize-1)];
+		htab[it->hash & (htabsize-1)] = it;
+	}
+}
+
+static void set_resetvalue(struct item *it, const char *str, int len)
+{
+	if (it->resetvalue != it->resetbuf)
+		arena_free(&strings, it->resetvalue, it->resetlen+1);
+	if (len < sizeof(it->resetbuf))
+		it->resetvalue = it->resetbuf;
+	else if (!(it->resetvalue = arena_alloc(&strings, len+1)))
+		mylog(LOG_ERR, "alloc reset value: %s", ESTR(errno));
+	memcpy(it->resetvalue, str, len);
+	it->resetvalue[len] = 0;
+	it->resetlen = len;
+}
+
+static void queue_subscribe(struct item *it)
+{
+	if (nsubq >= ssubq) {
+		ssubq = ssubq ? ssubq*2 : 64;
+		subq = realloc(subq, sizeof(*subq)*ssubq);
+		if (!subq)
+			mylog(LOG_ERR, "realloc %u subscriptions: %s", ssubq, ESTR(errno));
+	}
+	subq[nsubq++] = it;
+	it->subidx = nsubq;
+}
+
+static struct item *get_item(const char *topic, int len, int create)
+{
+	struct item *it;
+	unsigned int hash;
 
-	len = strlen(topic ?: "") - strlen(suffix ?: "");
 	if (len < 0)
 		return NULL;
-	/* match suffix */
-	if (strcmp(topic+len, suffix ?: ""))
-		return NULL;
 	/* match base topic */
-	for (it = items; it; it = it->next) {
-		if ((it->topiclen == len) && !strncmp(it->topic ?: "", topic, len))
+	hash = strhash(topic, len);
+	if (htabsize)
+	for (it = htab[hash & (htabsize-1)]; it; it = it->hnext) {
+		if ((it->hash == hash) && (it->topiclen == len) && !strncmp(it->topic, topic, len))
 			return it;
 	}
 	if (!create)
 		return NULL;
 	/* not found, create one */
-	it = malloc(sizeof(*it));
-	memset(it, 0, sizeof(*it));
-	it->topic = strndup(topic, len);
+	it = slab_alloc(&item_slab);
+	if (!it)
+		mylog(LOG_ERR, "alloc item: %s", ESTR(errno));
+	it->topic = arena_strndup(&strings, topic, len, mqtt_write_suffixlen);
+	if (!it->topic)
+		mylog(LOG_ERR, "alloc topic: %s", ESTR(errno));
 	it->topiclen = len;
-	if (mqtt_write_suffix)
-		asprintf(&it->writetopic, "%s%s", it->topic, mqtt_write_suffix);
-	it->resetvalue = strdup(mqtt_reset_value);
+	it->hash = hash;
+	set_resetvalue(it, mqtt_reset_value, strlen(mqtt_reset_value));
 	it->ontime = it->delay = NAN;
 
-	/* subscribe */
-	ret = mosquitto_subscribe(mosq, NULL, it->topic, mqtt_qos);
-	if (ret)
-		mylog(LOG_ERR, "mosquitto_subscribe '%s': %s", it->topic, mosquitto_strerror(ret));
+	/* subscribe, in the next batch */
+	if (mqtt_subscribe_items)
+		queue_subscribe(it);
 
 	/* insert in linked list */
 	it->next = items;
-	if (it->next) {
-		it->prev = it->next->prev;
-		it->next->prev = it;
-	} else
-		it->prev = (struct item *)(((char *)&items) - offsetof(struct item, next));
-	it->prev->next = it;
+	if (it->next)
+		it->next->prev = &it->next;
+	it->prev = &items;
+	items = it;
+
+	/* insert in hash table, keep load factor below 1 */
+	metric_set(&m_items, nitems+1);
+	if (++nitems > htabsize)
+		htab_grow();
+	else {
+		it->hnext = htab[hash & (htabsize-1)];
+		htab[hash & (htabsize-1)] = it;
+	}
 	return it;
 }
 
 static void drop_item(struct item *it)
 {
-	int ret;
+	struct item **pit;
+
+	for (pit = &htab[it->hash & (htabsize-1)]; *pit; pit = &(*pit)->hnext) {
+		if (*pit == it) {
+			*pit = it->hnext;
+			break;
+		}
+	}
+	metric_set(&m_items, --nitems);
+	want_snapshot();
 
 	/* remove from list */
-	if (it->prev)
-		it->prev->next = it->next;
+	*it->prev = it->next;
 	if (it->next)
 		it->next->prev = it->prev;
 
-	ret = mosquitto_unsubscribe(mosq, NULL, it->topic);
-	if (ret)
-		mylog(LOG_ERR, "mosquitto_unsubscribe '%s': %s", it->topic, mosquitto_strerror(ret));
+	if (it->subidx) {
+		/* subscription was not yet sent */
+		subq[it->subidx-1] = subq[--nsubq];
+		subq[it->subidx-1]->subidx = it->subidx;
+	} else if (it->subscribed) {
+		/* unsubscribe in the next batch, which takes the topic */
+		if (nunsubq >= sunsubq) {
+			sunsubq = sunsubq ? sunsubq*2 : 64;
+			unsubq = realloc(unsubq, sizeof(*unsubq)*sunsubq);
+			if (!unsubq)
+				mylog(LOG_ERR, "realloc %u unsubscriptions: %s", sunsubq, ESTR(errno));
+		}
+		unsubq[nunsubq++] = it->topic;
+		it->topic = NULL;
+	}
 
 	/* free memory */
-	free(it->topic);
-	if (it->writetopic)
-		free(it->writetopic);
-	if (it->resetvalue)
-		free(it->resetvalue);
-	free(it);
+	arena_free(&strings, it->topic, it->topiclen+1+mqtt_write_suffixlen);
+	if (it->resetvalue != it->resetbuf)
+		arena_free(&strings, it->resetvalue, it->resetlen+1);
+	slab_free(&item_slab, it);
+}
+
+static void mqtt_lost(const char *what, int ret);
+
+/* send pending (un)subscriptions, in multi-topic packets
+ * Unsubscribe first: a topic that was dropped and created again in
+ * the same burst is in both queues, and must remain subscribed.
+ */
+static void flush_subscriptions(void)
+{
+	char *topics[SUBQ_BATCH];
+	int ret, j, n;
+
+	while (nunsubq) {
+		n = (nunsubq > SUBQ_BATCH) ? SUBQ_BATCH : nunsubq;
+		nunsubq -= n;
+		ret = mosquitto_unsubscribe_multiple(mosq, NULL, n, unsubq+nunsubq, NULL);
+		if (ret)
+			/* a stale subscription does no harm */
+			mylog(LOG_WARNING, "mosquitto_unsubscribe %u topics: %s", n, mosquitto_strerror(ret));
+		for (j = 0; j < n; ++j)
+			arena_free(&strings, unsubq[nunsubq+j], strlen(unsubq[nunsubq+j])+1+mqtt_write_suffixlen);
+	}
+	while (nsubq) {
+		n = (nsubq > SUBQ_BATCH) ? SUBQ_BATCH : nsubq;
+		for (j = 0; j < n; ++j) {
+			topics[j] = subq[nsubq-n+j]->topic;
+			subq[nsubq-n+j]->subidx = 0;
+			subq[nsubq-n+j]->subscribed = 1;
+		}
+		ret = mosquitto_subscribe_multiple(mosq, NULL, n, topics, mqtt_qos, 0, NULL);
+		if (ret) {
+			/* keep them queued for after the reconnect */
+			for (j = 0; j < n; ++j) {
+				subq[nsubq-n+j]->subidx = nsubq-n+j+1;
+				subq[nsubq-n+j]->subscribed = 0;
+			}
+			mqtt_lost("mosquitto_subscribe", ret);
+			return;
+		}
+		nsubq -= n;
+	}
 }
 
 static void reset_item(void *dat)
 {
-	int ret;
 	struct item *it = dat;
 
-	/* publish, retained when writing the topic, volatile (not retained) when writing to another topic */
-	ret = mosquitto_publish(mosq, NULL, it->writetopic ?: it->topic, strlen(it->resetvalue), it->resetvalue, mqtt_qos, !mqtt_write_suffix);
-	if (ret < 0)
-		mylog(LOG_ERR, "mosquitto_publish %s: %s", it->writetopic ?: it->topic, mosquitto_strerror(ret));
+	if (!cluster_owns(it->hash)) {
+		/* the owner will publish */
+		it->missed = 1;
+		return;
+	}
+	it->missed = 0;
+	if (!isnan(it->ontime) && it->ontime)
+		metric_lag(&m_resetlag, libt_now() - it->ontime - it->delay);
+
+	/* publish, retained when writing the topic, volatile (not retained) when writing to another topic
+	 * The write topic is composed in the item's buffer.
+	 * The queue holds it while disconnected.
+	 */
+	if (mqtt_write_suffix)
+		strcpy(it->topic + it->topiclen, mqtt_write_suffix);
+	pubq_add(it->topic, it->resetvalue, it->resetlen, !mqtt_write_suffix);
+	mylog(LOG_INFO, "%s = %s", it->topic, it->resetvalue);
+	it->topic[it->topiclen] = 0;
 	/* clear cache too */
 	it->ontime = 0;
-	mylog(LOG_INFO, "%s = %s", it->writetopic ?: it->topic, it->resetvalue);
+	want_snapshot();
+}
+
+/* snapshot file layout */
+#define SNAPSHOT_MAGIC	"mqttimer"
+#define SNAPSHOT_VERSION	1
+struct snaphdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t nrec;
+};
+
+struct snaprec {
+	double delay;
+	/* wall clock time, 0 and NaN are kept as-is */
+	double ontime;
+	int32_t topiclen;
+	int32_t resetlen;
+	/* topic and reset value follow, padded to 8 bytes */
+};
+#define SNAPREC_SIZE(rec)	((sizeof(struct snaprec) + (rec)->topiclen + (rec)->resetlen + 7) & ~7)
+
+/* offset from libt's monotonic clock to wall clock */
+static double wallclock_offset(void)
+{
+	return wallclock() - libt_now();
+}
+
+static void save_snapshot(void *dat)
+{
+	struct snaphdr *hdr;
+	struct snaprec *rec;
+	struct item *it;
+	size_t len;
+	char *buf;
+	double offset;
+
+	libt_remove_timeout(save_snapshot, NULL);
+	snapshot_pending = 0;
+
+	for (len = sizeof(*hdr), it = items; it; it = it->next)
+		len += (sizeof(*rec) + it->topiclen + it->resetlen + 7) & ~7;
+	buf = malloc(len);
+	if (!buf)
+		mylog(LOG_ERR, "malloc snapshot: %s", ESTR(errno));
+	memset(buf, 0, len);
+	hdr = (void *)buf;
+	memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+	hdr->version = SNAPSHOT_VERSION;
+	hdr->nrec = nitems;
+	offset = wallclock_offset();
+	for (len = sizeof(*hdr), it = items; it; it = it->next) {
+		rec = (void *)(buf + len);
+		rec->delay = it->delay;
+		rec->ontime = (isnan(it->ontime) || !it->ontime) ? it->ontime : it->ontime + offset;
+		rec->topiclen = it->topiclen;
+		rec->resetlen = it->resetlen;
+		memcpy(rec+1, it->topic, it->topiclen);
+		memcpy((char *)(rec+1) + it->topiclen, it->resetvalue, it->resetlen);
+		len += SNAPREC_SIZE(rec);
+	}
+	if (snapshot_save(state_file, buf, len) < 0)
+		mylog(LOG_WARNING, "save %s: %s", state_file, ESTR(errno));
+	free(buf);
+}
+
+/* drop snapshot timers whose spec did not come back in the retained replay */
+static void expire_snapshot(void *dat)
+{
+	struct item *it, *next;
+	int n = 0;
+
+	for (it = items; it; it = next) {
+		next = it->next;
+		if (!it->snap)
+			continue;
+		mylog(LOG_INFO, "snapshot timer spec for %s vanished", it->topic);
+		libt_remove_timeout(reset_item, it);
+		drop_item(it);
+		++n;
+	}
+	if (n)
+		mylog(LOG_NOTICE, "dropped %u timers from snapshot", n);
+}
+
+static void load_snapshot(void)
+{
+	const struct snaphdr *hdr;
+	const struct snaprec *rec;
+	const char *map;
+	struct item *it;
+	size_t len, pos;
+	double offset;
+	int j;
+
+	map = snapshot_map(state_file, &len);
+	if (!map) {
+		if (errno != ENOENT)
+			mylog(LOG_WARNING, "load %s: %s", state_file, ESTR(errno));
+		return;
+	}
+	hdr = (const void *)map;
+	if (len < sizeof(*hdr) || memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) ||
+			hdr->version != SNAPSHOT_VERSION) {
+		mylog(LOG_WARNING, "%s: no valid snapshot", state_file);
+		goto done;
+	}
+	offset = wallclock_offset();
+	for (j = 0, pos = sizeof(*hdr); j < hdr->nrec; ++j, pos += SNAPREC_SIZE(rec)) {
+		rec = (const void *)(map + pos);
+		if (pos + sizeof(*rec) > len || rec->topiclen <= 0 || rec->resetlen < 0 ||
+				pos + SNAPREC_SIZE(rec) > len) {
+			mylog(LOG_WARNING, "%s: truncated snapshot", state_file);
+			break;
+		}
+		it = get_item((const char *)(rec+1), rec->topiclen, 1);
+		set_resetvalue(it, (const char *)(rec+1) + rec->topiclen, rec->resetlen);
+		it->delay = rec->delay;
+		it->ontime = (isnan(rec->ontime) || !rec->ontime) ? rec->ontime : rec->ontime - offset;
+		it->snap = 1;
+		/* timeouts that expired while not running fire right away */
+		if (!isnan(it->ontime) && it->ontime)
+			libt_add_timeouta(it->ontime + it->delay, reset_item, it);
+	}
+	mylog(LOG_NOTICE, "loaded %u timers from %s", nitems, state_file);
+done:
+	snapshot_unmap(map, len);
 }
 
 static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitto_message *msg)
 {
-	char *tok;
+	const char *str;
 	struct item *it;
+	int len, n, used;
 
-	if ((it = get_item(msg->topic, mqtt_suffix, !!msg->payloadlen)) != NULL) {
+	if (cluster_msg(mosq, msg->topic, msg->payload, msg->payloadlen, mqtt_qos))
+		return;
+	len = strlen(msg->topic) - mqtt_suffixlen;
+	if (len >= 0 && !strcmp(msg->topic+len, mqtt_suffix) &&
+			(it = get_item(msg->topic, len, !!msg->payloadlen)) != NULL) {
 		/* this is a spec msg */
+		metric_inc(&m_msgs_spec);
+		it->snap = 0;
+		want_snapshot();
 		if (!msg->payloadlen) {
 			mylog(LOG_INFO, "removed timer spec for %s", it->topic);
 			libt_remove_timeout(reset_item, it);
@@ -213,27 +567,26 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 			return;
 		}
 
-		/* process timeout spec */
-		tok = strtok(msg->payload, " \t");
-		if (tok) {
-			it->delay = strtod(tok, &tok);
-			switch (tolower(*tok)) {
-			case 'w':
-				it->delay *= 7;
-			case 'd':
-				it->delay *= 24;
-			case 'h':
-				it->delay *= 60;
-			case 'm':
-				it->delay *= 60;
-				break;
-			}
+		/* process timeout spec: DELAY [RESETVALUE] */
+		str = msg->payload;
+		n = msg->payloadlen;
+		for (; n && strchr(" \t", *str); ++str, --n);
+		if (n) {
+			it->delay = strncasetodelay(str, n, &used);
+			/* skip remainder of token */
+			for (; used < n && !strchr(" \t", str[used]); ++used);
+			str += used;
+			n -= used;
 		} else
 			it->delay = NAN;
 
 		/* find new reset value */
-		free(it->resetvalue);
-		it->resetvalue = strdup(strtok(NULL, " \t") ?: mqtt_reset_value);
+		for (; n && strchr(" \t", *str); ++str, --n);
+		for (used = 0; used < n && !strchr(" \t", str[used]); ++used);
+		if (used)
+			set_resetvalue(it, str, used);
+		else
+			set_resetvalue(it, mqtt_reset_value, strlen(mqtt_reset_value));
 
 		mylog(LOG_INFO, "timer spec for %s: %.2lfs '%s'", it->topic, it->delay, it->resetvalue ?: "");
 
@@ -243,17 +596,22 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 			mylog(LOG_INFO, "%s: schedule action in %.2lfs", it->topic, it->delay);
 		}
 
-	} else if ((it = get_item(msg->topic, NULL, 0)) != NULL) {
+	} else if ((it = get_item(msg->topic, strlen(msg->topic), 0)) != NULL) {
 		/* this is the main timer topic */
-		if (!strcmp(it->resetvalue, ((char *)msg->payload) ?: "")) {
+		metric_inc(&m_msgs_value);
+		pubq_seen(msg->topic, msg->payload, msg->payloadlen);
+		if (it->resetlen == msg->payloadlen && !memcmp(it->resetvalue, msg->payload, msg->payloadlen)) {
 			/* value was reset */
 			libt_remove_timeout(reset_item, it);
+			it->missed = 0;
 			it->ontime = NAN;
 			if (!isnan(it->delay))
 				mylog(LOG_INFO, "%s: reverted, no action required", it->topic);
+			want_snapshot();
 		} else if (isnan(it->ontime)) {
 			/* set ontime only on first set */
 			it->ontime = libt_now();
+			want_snapshot();
 			libt_add_timeouta(it->ontime + it->delay, reset_item, it);
 			if (!isnan(it->delay))
 				mylog(LOG_INFO, "%s: schedule action in %.2lfs", it->topic, it->delay);
@@ -263,15 +621,151 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 
 static void my_exit(void)
 {
-	if (mosq)
+	if (snapshot_pending)
+		save_snapshot(NULL);
+	if (mosq) {
+		/* hand over our timers right away */
+		cluster_leave(mosq, mqtt_qos);
 		mosquitto_disconnect(mosq);
+	}
+}
+
+/* cluster membership changed, take over what the previous owner left */
+static void cluster_changed(void)
+{
+	struct item *it;
+
+	for (it = items; it; it = it->next) {
+		if (it->missed && cluster_owns(it->hash))
+			reset_item(it);
+	}
+}
+
+/* mid of the pattern SUBSCRIBE */
+static int patmid;
+
+static void subscribe_patterns(void)
+{
+	int ret;
+
+	/* all patterns in 1 SUBSCRIBE */
+	ret = mosquitto_subscribe_multiple(mosq, &patmid, mqtt_npatterns, mqtt_patterns, mqtt_qos, 0, NULL);
+	if (ret)
+		mylog(LOG_WARNING, "mosquitto_subscribe %u patterns: %s", mqtt_npatterns, mosquitto_strerror(ret));
+}
+
+static void my_mqtt_subscribe(struct mosquitto *mosq, void *dat, int mid, int qos_count, const int *granted_qos)
+{
+	static int subacked;
+
+	if (mid != patmid || subacked)
+		return;
+	subacked = 1;
+	if (state_file)
+		/* the retained replay follows now, give it time to confirm the snapshot */
+		libt_add_timeout(SNAPSHOT_GRACE, expire_snapshot, NULL);
+}
+
+static void my_mqtt_connect(struct mosquitto *mosq, void *dat, int rc, int flags)
+{
+	static int connected_once;
+	struct item *it;
+
+	if (rc) {
+		mylog(LOG_WARNING, "connect %s:%i refused: %s", mqtt_host, mqtt_port, mosquitto_connack_string(rc));
+		return;
+	}
+	/* the broker remembers our subscriptions when it kept the session */
+	if (!connected_once || !(flags & 1)) {
+		subscribe_patterns();
+		for (it = items; it; it = it->next) {
+			if (it->subscribed && !it->subidx) {
+				it->subscribed = 0;
+				queue_subscribe(it);
+			}
+		}
+	}
+	if (cluster_group)
+		/* the will may have removed our lease */
+		cluster_join(mosq, mqtt_qos);
+	if (connected_once)
+		mylog(LOG_NOTICE, "reconnected to %s:%i%s", mqtt_host, mqtt_port, (flags & 1) ? "" : ", new session");
+	connected_once = 1;
+	reconnect_delay = 0;
+}
+
+/* return the delay for the next reconnect attempt, and increase it */
+static double reconnect_backoff(void)
+{
+	double delay = reconnect_delay;
+
+	reconnect_delay = delay ? delay*2 : RECONNECT_MIN;
+	if (reconnect_delay > RECONNECT_MAX)
+		reconnect_delay = RECONNECT_MAX;
+	return delay;
+}
+
+static void do_mqtt_maintenance(void *dat);
+
+static void do_mqtt_reconnect(void *dat)
+{
+	int ret;
+	double delay;
+
+	ret = mosquitto_reconnect(dat);
+	if (ret) {
+		delay = reconnect_backoff();
+		mylog(LOG_INFO, "mosquitto_reconnect: %s, retry in %.0lfs", mosquitto_strerror(ret), delay);
+		libt_add_timeout(delay, do_mqtt_reconnect, dat);
+		return;
+	}
+	mqtt_connected = 1;
+	libt_add_timeout(0, do_mqtt_maintenance, dat);
+}
+
+/* the connection broke, timers keep running while reconnecting */
+static void mqtt_lost(const char *what, int ret)
+{
+	if (!mqtt_connected)
+		return;
+	mylog(LOG_WARNING, "%s: %s, reconnecting", what, mosquitto_strerror(ret));
+	mqtt_connected = 0;
+	libt_add_timeout(reconnect_backoff(), do_mqtt_reconnect, mosq);
+}
+
+/* libmosquitto pings once the connection was silent in either direction
+ * for the keepalive, counting whole seconds, so wake up 1s later.
+ * The socket tells when that is.
+ */
+static void do_mqtt_maintenance(void *dat)
+{
+	double idle;
+	int ret;
+
+	if (!mqtt_connected)
+		/* the reconnect restarts it */
+		return;
+	idle = sock_idle(mosquitto_socket(dat));
+	if (idle >= 0 && idle < mqtt_keepalive + 1) {
+		libt_add_timeout(mqtt_keepalive + 1 - idle, do_mqtt_maintenance, dat);
+		return;
+	}
+	ret = mosquitto_loop_misc(dat);
+	if (ret) {
+		mqtt_lost("mosquitto_loop_misc", ret);
+		return;
+	}
+	/* the PINGRESP is due within keepalive,
+	 * without socket info, run a few times per interval
+	 */
+	libt_add_timeout((idle < 0) ? mqtt_keepalive / 4.0 : mqtt_keepalive + 1, do_mqtt_maintenance, dat);
 }
 
 int main(int argc, char *argv[])
 {
-	int opt, ret, waittime;
+	int opt, ret, pending;
 	char *str;
-	char mqtt_name[32];
+	char mqtt_name[80];
 	int logmask = LOG_UPTO(LOG_NOTICE);
 
 	/* argument parsing */
@@ -300,6 +794,9 @@ int main(int argc, char *argv[])
 			mqtt_port = strtoul(str+1, NULL, 10);
 		}
 		break;
+	case 'i':
+		mqtt_id = optarg;
+		break;
 	case 'r':
 		mqtt_reset_value = optarg;
 		break;
@@ -309,6 +806,28 @@ int main(int argc, char *argv[])
 		break;
 	case 'w':
 		mqtt_write_suffix = optarg;
+		mqtt_write_suffixlen = strlen(optarg);
+		break;
+	case 'N':
+		mqtt_subscribe_items = 0;
+		break;
+	case 'f':
+		state_file = optarg;
+		break;
+	case 'C':
+		cluster_group = optarg;
+		break;
+	case 'R':
+		replay_file = optarg;
+		break;
+	case 'p':
+		precise = 1;
+		break;
+	case 'a':
+		coalesce = strntodelay(optarg, strlen(optarg), NULL);
+		break;
+	case 'l':
+		slack = strntodelay(optarg, strlen(optarg), NULL);
 		break;
 
 	default:
@@ -319,43 +838,145 @@ int main(int argc, char *argv[])
 		break;
 	}
 
+	if (replay_file && cluster_group) {
+		fputs("-R works without -C\n", stderr);
+		exit(1);
+	}
+
+	if (precise && (coalesce > 0 || slack > 0)) {
+		fputs("-p works without -a and -l\n", stderr);
+		exit(1);
+	}
+
 	atexit(my_exit);
 	openlog(NAME, LOG_PERROR, LOG_LOCAL2);
 	setlogmask(logmask);
+	if (precise)
+		tsource_precise();
+	tsource_coalesce(coalesce);
+	if (slack > 0)
+		tsource_slack(slack);
+	if (replay_file) {
+		/* before any timeout, the clock changes */
+		replay_init(replay_file);
+		/* the trace holds all messages */
+		mqtt_subscribe_items = 0;
+	}
 
 	/* MQTT start */
 	mosquitto_lib_init();
-	sprintf(mqtt_name, "%s-%i", NAME, getpid());
-	mosq = mosquitto_new(mqtt_name, true, 0);
+	if (!mqtt_id) {
+		/* a stable id, so the broker keeps our session */
+		strcpy(mqtt_name, NAME "-");
+		gethostname(mqtt_name+strlen(mqtt_name), sizeof(mqtt_name)-strlen(mqtt_name)-1);
+		mqtt_name[sizeof(mqtt_name)-1] = 0;
+		mqtt_id = mqtt_name;
+	}
+	if (replay_file)
+		goto replay;
+	mosq = mosquitto_new(mqtt_id, false, 0);
 	if (!mosq)
 		mylog(LOG_ERR, "mosquitto_new failed: %s", ESTR(errno));
-	/* mosquitto_will_set(mosq, "TOPIC", 0, NULL, mqtt_qos, 1); */
+	if (cluster_group) {
+		cluster_init(cluster_group, mqtt_id, cluster_changed);
+		/* the broker drops our lease when we vanish */
+		ret = mosquitto_will_set(mosq, cluster_topic(), 0, NULL, mqtt_qos, 1);
+		if (ret)
+			mylog(LOG_ERR, "mosquitto_will_set: %s", mosquitto_strerror(ret));
+	}
 
 	mosquitto_log_callback_set(mosq, my_mqtt_log);
 	mosquitto_message_callback_set(mosq, my_mqtt_msg);
+	mosquitto_subscribe_callback_set(mosq, my_mqtt_subscribe);
+	mosquitto_connect_with_flags_callback_set(mosq, my_mqtt_connect);
 
 	ret = mosquitto_connect(mosq, mqtt_host, mqtt_port, mqtt_keepalive);
 	if (ret)
 		mylog(LOG_ERR, "mosquitto_connect %s:%i: %s", mqtt_host, mqtt_port, mosquitto_strerror(ret));
+	mqtt_connected = 1;
+
+replay:
+	/* SUBSCRIBE, when connected */
+	mqtt_npatterns = (optind < argc) ? argc-optind : 1;
+	mqtt_patterns = malloc(sizeof(*mqtt_patterns)*(mqtt_npatterns+1));
+	if (!mqtt_patterns)
+		mylog(LOG_ERR, "malloc patterns: %s", ESTR(errno));
+	if (optind < argc)
+		memcpy(mqtt_patterns, argv+optind, sizeof(*mqtt_patterns)*mqtt_npatterns);
+	else
+		mqtt_patterns[0] = "#";
+	if (cluster_group)
+		mqtt_patterns[mqtt_npatterns++] = (char *)cluster_pattern();
+
+	if (state_file) {
+		/* warm start, pending timeouts run on, the retained replay becomes a diff */
+		load_snapshot();
+		if (replay_file)
+			/* the trace starts with the retained replay */
+			libt_add_timeout(SNAPSHOT_GRACE, expire_snapshot, NULL);
+	}
 
-	if (optind >= argc) {
-		ret = mosquitto_subscribe(mosq, NULL, "#", mqtt_qos);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_subscribe '#': %s", mosquitto_strerror(ret));
-	} else for (; optind < argc; ++optind) {
-		ret = mosquitto_subscribe(mosq, NULL, argv[optind], mqtt_qos);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_subscribe %s: %s", argv[optind], mosquitto_strerror(ret));
+	if (replay_file) {
+		/* the simulated clock jumps from event to event */
+		metrics_init(NAME);
+		do {
+			libt_flush();
+			metrics_poll();
+			pubq_flush_to(replay_pub);
+			logq_flush();
+		} while (replay_step(0, my_mqtt_msg, NULL) >= 0);
+		pubq_flush_to(replay_pub);
+		fflush(stdout);
+		return 0;
 	}
 
+	/* loop */
+	libt_add_timeout(0, do_mqtt_maintenance, mosq);
+	struct pollfd pf[2] = {
+		[0] = { .fd = mosquitto_socket(mosq), .events = POLL_IN, },
+		[1] = { .fd = tsource_init(), .events = POLL_IN, },
+	};
+	metrics_init(NAME);
 	while (1) {
 		libt_flush();
-		waittime = libt_get_waittime();
-		if (waittime > 1000)
-			waittime = 1000;
-		ret = mosquitto_loop(mosq, waittime, 1);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_loop: %s", mosquitto_strerror(ret));
+		metrics_poll();
+		/* (un)subscriptions and publishes wait while disconnected */
+		pending = mqtt_connected && (nsubq || nunsubq);
+		if (pending && nsubq >= SUBQ_BATCH)
+			flush_subscriptions();
+		if (mqtt_connected && pubq_flush(mosq, mqtt_qos) < 0)
+			mqtt_lost("mosquitto_publish", MOSQ_ERR_NO_CONN);
+		if (mqtt_connected && mosquitto_want_write(mosq)) {
+			ret = mosquitto_loop_write(mosq, 1);
+			if (ret)
+				mqtt_lost("mosquitto_loop_write", ret);
+		}
+		/* the socket changes on reconnect, poll ignores -1 */
+		pf[0].fd = mqtt_connected ? mosquitto_socket(mosq) : -1;
+		if (!pending)
+			/* idle, write the log */
+			logq_flush();
+		/* sleep until the timerfd wakes us for the next timeout, or MQTT traffic */
+		tsource_arm();
+		ret = poll(pf, 2, pending ? 0 : -1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			mylog(LOG_ERR, "poll ...");
+		if (!ret && pending) {
+			/* incoming messages are drained */
+			flush_subscriptions();
+			continue;
+		}
+		if (pf[0].revents) {
+			/* mqtt read ... */
+			ret = mosquitto_loop_read(mosq, 1);
+			if (ret)
+				mqtt_lost("mosquitto_loop_read", ret);
+		}
+		if (pf[1].revents)
+			/* the timeouts run at the top, a clock change needs a rearm only */
+			tsource_read();
 	}
 	return 0;
 }
@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <mosquitto.h>
+#include <mqtt_protocol.h>
+
+#include "common.h"
+#include "pubq.h"
+#include "metrics.h"
+
+METRIC(m_pubs, "publishes");
+METRIC(m_pubfail, "publish.errors");
+
+struct pubent {
+	/* hash table collision chain */
+	struct pubent *hnext;
+	unsigned int hash;
+	/* queue of pending publishes */
+	struct pubent *qnext;
+
+	char *topic;
+	/* last value sent or seen, for retained topics */
+	char *value;
+	int valuelen;
+	int known;
+	/* pending value */
+	char *pending;
+	int pendlen;
+	int queued;
+	int retain;
+	/* optional MQTT v5 user property, static strings */
+	const char *propname, *propvalue;
+	/* MQTT v5 topic alias */
+	int npub;
+	int alias;
+	int aliassent;
+};
+
+struct pubq {
+	struct pubent **htab;
+	int htabsize;
+	int nent;
+	struct pubent *queue, **qlast;
+	int nqueued;
+	/* MQTT v5 topic aliases, for this connection */
+	int v5;
+	int aliasmax;
+	struct pubent **aliases;
+	int naliases;
+	int *freealiases;
+	int nfreealiases;
+};
+
+/* the default queue, and the one in use */
+static struct pubq defq, *s = &defq;
+
+/* topics get an alias on their 2nd publish, while aliases are available */
+#define ALIAS_MINPUB	2
+
+static void pubq_grow(void)
+{
+	struct pubent **newtab, *ent, *next;
+	int newsize = s->htabsize ? s->htabsize*2 : 64;
+	int j;
+
+	newtab = malloc(sizeof(*newtab)*newsize);
+	if (!newtab) {
+		syslog(LOG_ERR, "malloc %u queued topics: %s", newsize, strerror(errno));
+		exit(1);
+	}
+	memset(newtab, 0, sizeof(*newtab)*newsize);
+	for (j = 0; j < s->htabsize; ++j) {
+		for (ent = s->htab[j]; ent; ent = next) {
+			next = ent->hnext;
+			ent->hnext = newtab[ent->hash & (newsize-1)];
+			newtab[ent->hash & (newsize-1)] = ent;
+		}
+	}
+	free(s->htab);
+	s->htab = newtab;
+	s->htabsize = newsize;
+}
+
+static struct pubent *pubq_find(const char *topic, int create)
+{
+	struct pubent *ent;
+	unsigned int hash;
+	int len = strlen(topic);
+
+	hash = strhash(topic, len);
+	if (s->htabsize)
+	for (ent = s->htab[hash & (s->htabsize-1)]; ent; ent = ent->hnext) {
+		if (ent->hash == hash && !strcmp(ent->topic, topic))
+			return ent;
+	}
+	if (!create)
+		return NULL;
+	ent = malloc(sizeof(*ent));
+	if (!ent) {
+		syslog(LOG_ERR, "malloc queued topic: %s", strerror(errno));
+		exit(1);
+	}
+	memset(ent, 0, sizeof(*ent));
+	ent->topic = strdup(topic);
+	if (!ent->topic) {
+		syslog(LOG_ERR, "strdup queued topic: %s", strerror(errno));
+		exit(1);
+	}
+	ent->hash = hash;
+	if (++s->nent > s->htabsize)
+		pubq_grow();
+	ent->hnext = s->htab[hash & (s->htabsize-1)];
+	s->htab[hash & (s->htabsize-1)] = ent;
+	return ent;
+}
+
+static void pubq_drop(struct pubent *ent)
+{
+	struct pubent **pent;
+
+	for (pent = &s->htab[ent->hash & (s->htabsize-1)]; *pent; pent = &(*pent)->hnext) {
+		if (*pent == ent) {
+			*pent = ent->hnext;
+			break;
+		}
+	}
+	--s->nent;
+	if (ent->alias) {
+		s->aliases[ent->alias-1] = NULL;
+		s->freealiases[s->nfreealiases++] = ent->alias;
+	}
+	free(ent->topic);
+	free(ent->value);
+	free(ent->pending);
+	free(ent);
+}
+
+static int pubq_equal(const char *a, int alen, const void *b, int blen)
+{
+	return alen == blen && (!alen || !memcmp(a, b, alen));
+}
+
+static void pubq_setval(char **pval, int *plen, const void *payload, int len)
+{
+	*pval = realloc(*pval, len+1);
+	if (!*pval) {
+		syslog(LOG_ERR, "realloc payload of %u bytes: %s", len+1, strerror(errno));
+		exit(1);
+	}
+	if (len)
+		memcpy(*pval, payload, len);
+	(*pval)[len] = 0;
+	*plen = len;
+}
+
+struct pubq *pubq_new(void)
+{
+	struct pubq *q;
+
+	q = malloc(sizeof(*q));
+	if (!q) {
+		syslog(LOG_ERR, "malloc publish queue: %s", strerror(errno));
+		exit(1);
+	}
+	memset(q, 0, sizeof(*q));
+	return q;
+}
+
+void pubq_select(struct pubq *q)
+{
+	s = q ?: &defq;
+}
+
+void pubq_add(const char *topic, const void *payload, int len, int retain)
+{
+	pubq_add_prop(topic, payload, len, retain, NULL, NULL);
+}
+
+void pubq_add_prop(const char *topic, const void *payload, int len, int retain,
+		const char *propname, const char *propvalue)
+{
+	struct pubent *ent;
+
+	ent = pubq_find(topic, 1);
+	if (retain && ent->known && pubq_equal(ent->value, ent->valuelen, payload, len)) {
+		/* the retained value does not change */
+		if (ent->queued)
+			/* cancel the pending publish, it becomes void */
+			ent->retain = -1;
+		return;
+	}
+	pubq_setval(&ent->pending, &ent->pendlen, payload, len);
+	ent->retain = retain;
+	ent->propname = propname;
+	ent->propvalue = propvalue;
+	if (!ent->queued) {
+		if (!s->queue)
+			s->qlast = &s->queue;
+		ent->qnext = NULL;
+		*s->qlast = ent;
+		s->qlast = &ent->qnext;
+		ent->queued = 1;
+		++s->nqueued;
+	}
+}
+
+void pubq_seen(const char *topic, const void *payload, int len)
+{
+	struct pubent *ent;
+
+	ent = pubq_find(topic, 0);
+	if (!ent || !ent->known)
+		return;
+	/* Someone else may have changed the value.
+	 * Since the retain flag does not tell whether the broker stored it,
+	 * just forget the value, so the next publish is not dropped.
+	 */
+	if (!pubq_equal(ent->value, ent->valuelen, payload, len))
+		ent->known = 0;
+}
+
+int pubq_pending(void)
+{
+	return s->nqueued;
+}
+
+void pubq_set_v5(int aliasmax)
+{
+	int j;
+
+	/* aliases are valid for 1 connection only */
+	for (j = 0; j < s->aliasmax; ++j) {
+		if (s->aliases[j])
+			s->aliases[j]->alias = 0;
+	}
+	s->v5 = 1;
+	s->aliasmax = aliasmax;
+	s->naliases = s->nfreealiases = 0;
+	s->aliases = realloc(s->aliases, sizeof(*s->aliases)*aliasmax);
+	s->freealiases = realloc(s->freealiases, sizeof(*s->freealiases)*aliasmax);
+	if (aliasmax && (!s->aliases || !s->freealiases)) {
+		syslog(LOG_ERR, "realloc %u topic aliases: %s", aliasmax, strerror(errno));
+		exit(1);
+	}
+	memset(s->aliases, 0, sizeof(*s->aliases)*aliasmax);
+}
+
+static void pubq_assign_alias(struct pubent *ent)
+{
+	if (ent->alias || ++ent->npub < ALIAS_MINPUB)
+		return;
+	if (s->nfreealiases)
+		ent->alias = s->freealiases[--s->nfreealiases];
+	else if (s->naliases < s->aliasmax)
+		ent->alias = ++s->naliases;
+	else
+		return;
+	s->aliases[ent->alias-1] = ent;
+	ent->aliassent = 0;
+}
+
+static int pubq_publish_v5(struct mosquitto *mosq, struct pubent *ent, int qos)
+{
+	mosquitto_property *props = NULL;
+	const char *topic = ent->topic;
+	int ret;
+
+	pubq_assign_alias(ent);
+	if (ent->alias) {
+		mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS, ent->alias);
+		if (ent->aliassent)
+			/* the broker knows the topic */
+			topic = NULL;
+	}
+	if (ent->propname)
+		mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, ent->propname, ent->propvalue);
+	ret = mosquitto_publish_v5(mosq, NULL, topic, ent->pendlen, ent->pending, qos, ent->retain, props);
+	mosquitto_property_free_all(&props);
+	if (!ret && ent->alias)
+		ent->aliassent = 1;
+	return ret;
+}
+
+static int pubq_send(struct mosquitto *mosq, int qos,
+		void (*fn)(const char *topic, const void *payload, int len, int retain))
+{
+	struct pubent *ent;
+	int ret, cnt = 0;
+
+	while (s->queue) {
+		ent = s->queue;
+		if (ent->retain >= 0) {
+			if (fn) {
+				fn(ent->topic, ent->pending, ent->pendlen, ent->retain);
+				ret = 0;
+			} else if (s->v5)
+				ret = pubq_publish_v5(mosq, ent, qos);
+			else
+				ret = mosquitto_publish(mosq, NULL, ent->topic, ent->pendlen, ent->pending, qos, ent->retain);
+			if (ret) {
+				metric_inc(&m_pubfail);
+				syslog(LOG_WARNING, "mosquitto_publish %s: %s", ent->topic, mosquitto_strerror(ret));
+				return -1;
+			}
+			metric_inc(&m_pubs);
+			++cnt;
+		}
+		s->queue = ent->qnext;
+		ent->queued = 0;
+		--s->nqueued;
+		if (ent->retain < 0)
+			/* cancelled */
+			continue;
+		if (!ent->retain) {
+			/* volatile messages are not remembered */
+			if (!ent->known)
+				pubq_drop(ent);
+		} else if (!ent->pendlen)
+			/* the topic is cleared, forget it */
+			pubq_drop(ent);
+		else {
+			/* remember what we published */
+			free(ent->value);
+			ent->value = ent->pending;
+			ent->valuelen = ent->pendlen;
+			ent->known = 1;
+			ent->pending = NULL;
+			ent->pendlen = 0;
+		}
+	}
+	return cnt;
+}
+
+int pubq_flush(struct mosquitto *mosq, int qos)
+{
+	return pubq_send(mosq, qos, NULL);
+}
+
+int pubq_flush_to(void (*fn)(const char *topic, const void *payload, int len, int retain))
+{
+	return pubq_send(NULL, 0, fn);
+}
@@ -0,0 +1,41 @@
+#ifndef _pubq_h_
+#define _pubq_h_
+
+struct mosquitto;
+struct pubq;
+
+/* several connections need a queue each
+ * All other calls act on the selected queue,
+ * pubq_select(NULL) selects the default queue.
+ */
+extern struct pubq *pubq_new(void);
+extern void pubq_select(struct pubq *q);
+
+/* queue a publish
+ * Only the last value per topic is kept, and retained values
+ * that equal the last known value are dropped.
+ */
+extern void pubq_add(const char *topic, const void *payload, int len, int retain);
+/* same, with an MQTT v5 user property, @propname & @propvalue must remain valid */
+extern void pubq_add_prop(const char *topic, const void *payload, int len, int retain,
+		const char *propname, const char *propvalue);
+
+/* learn the current value of a topic from an incoming message */
+extern void pubq_seen(const char *topic, const void *payload, int len);
+
+/* return the number of queued publishes */
+extern int pubq_pending(void);
+
+/* publish with MQTT v5, called on each CONNACK
+ * Frequently published topics get one of @aliasmax topic aliases.
+ */
+extern void pubq_set_v5(int aliasmax);
+
+/* send all queued publishes, in the order they were queued
+ * returns the number of messages sent, or < 0 on error
+ */
+extern int pubq_flush(struct mosquitto *mosq, int qos);
+/* same, but hand them to @fn instead of a broker, i.e. for a replay */
+extern int pubq_flush_to(void (*fn)(const char *topic, const void *payload, int len, int retain));
+
+#endif
@@ -0,0 +1,199 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <mosquitto.h>
+
+#include "lib/libt.h"
+#include "common.h"
+#include "replay.h"
+
+/* a publish, on its way back as the broker would do
+ * A broker forwards to existing subscriptions without the retain flag,
+ * only the printed timeline keeps it.
+ */
+struct echo {
+	struct echo *next;
+	int len;
+	char *payload;
+	char topic[1];
+};
+
+static struct {
+	const char *file;
+	FILE *fp;
+	int lineno;
+	char *line;
+	size_t linesize;
+	/* the next event, -1 at the end */
+	double next;
+	int type;
+	char *topic;
+	char *payload;
+	/* simulated monotonic clock, and its offset to the wall clock */
+	double mono;
+	double offset;
+	/* our own publishes, to deliver back */
+	struct echo *echo, **echolast;
+} s;
+
+static double replay_mono(void)
+{
+	return s.mono;
+}
+
+static double replay_wall(void)
+{
+	return s.mono + s.offset;
+}
+
+/* read the next event of the trace */
+static void replay_read(void)
+{
+	char *str, *end;
+	ssize_t len;
+
+	for (;;) {
+		len = getline(&s.line, &s.linesize, s.fp);
+		if (len < 0) {
+			s.next = -1;
+			return;
+		}
+		++s.lineno;
+		if (len && s.line[len-1] == '\n')
+			s.line[--len] = 0;
+		str = s.line + strspn(s.line, " \t");
+		if (!*str || *str == '#')
+			continue;
+		s.next = strtod(str, &end);
+		if (end == str) {
+			syslog(LOG_WARNING, "%s:%i: no time", s.file, s.lineno);
+			continue;
+		}
+		str = end + strspn(end, " \t");
+		if (!*str || !strchr("RMJE", *str) || (str[1] && !strchr(" \t", str[1]))) {
+			syslog(LOG_WARNING, "%s:%i: bad event", s.file, s.lineno);
+			continue;
+		}
+		s.type = *str++;
+		str += strspn(str, " \t");
+		s.topic = str;
+		s.payload = NULL;
+		if ((s.type == 'R' || s.type == 'M') && !*s.topic) {
+			syslog(LOG_WARNING, "%s:%i: no topic", s.file, s.lineno);
+			continue;
+		}
+		str = strpbrk(str, " \t");
+		if (str) {
+			*str++ = 0;
+			s.payload = str;
+		}
+		/* late events are passed right away, the clock does not go back */
+		return;
+	}
+}
+
+void replay_init(const char *file)
+{
+	s.file = file;
+	s.fp = fopen(file, "r");
+	if (!s.fp) {
+		syslog(LOG_ERR, "fopen %s: %s", file, strerror(errno));
+		exit(1);
+	}
+	replay_read();
+	if (s.next < 0) {
+		syslog(LOG_ERR, "%s: no events", file);
+		exit(1);
+	}
+	s.mono = s.next;
+	s.echolast = &s.echo;
+	libt_set_clock(replay_mono);
+	set_wallclock(replay_wall);
+}
+
+int replay_step(time_t wakeup,
+		void (*msg)(struct mosquitto *mosq, void *dat, const struct mosquitto_message *msg),
+		void *dat)
+{
+	struct mosquitto_message m;
+	double t, next;
+	struct echo *e;
+	int ret = 0;
+
+	if (s.echo) {
+		/* deliver our own publishes first, the clock stands still */
+		while ((e = s.echo) != NULL) {
+			s.echo = e->next;
+			if (!s.echo)
+				s.echolast = &s.echo;
+			memset(&m, 0, sizeof(m));
+			m.topic = e->topic;
+			m.payload = e->payload;
+			m.payloadlen = e->len;
+			msg(NULL, dat, &m);
+			free(e);
+		}
+		return 0;
+	}
+	if (s.next < 0)
+		return -1;
+	/* the earliest event */
+	next = s.next;
+	t = libt_next_wakeup();
+	if (t >= 0 && t + s.offset < next)
+		next = t + s.offset;
+	if (wakeup > 0 && wakeup < next)
+		next = wakeup;
+	if (next > replay_wall())
+		s.mono = next - s.offset;
+
+	while (s.next >= 0 && s.next <= replay_wall()) {
+		switch (s.type) {
+		case 'E':
+			s.next = -1;
+			return -1;
+		case 'J':
+			s.offset += strtod(s.topic, NULL) - replay_wall();
+			ret = 1;
+			break;
+		default:
+			memset(&m, 0, sizeof(m));
+			m.topic = s.topic;
+			m.payload = s.payload;
+			m.payloadlen = s.payload ? strlen(s.payload) : 0;
+			m.retain = s.type == 'R';
+			msg(NULL, dat, &m);
+			break;
+		}
+		replay_read();
+	}
+	return ret;
+}
+
+void replay_pub(const char *topic, const void *payload, int len, int retain)
+{
+	struct echo *e;
+	int tlen = strlen(topic);
+
+	e = malloc(sizeof(*e) + tlen + len + 1);
+	if (!e) {
+		syslog(LOG_ERR, "malloc echo: %s", strerror(errno));
+		exit(1);
+	}
+	e->next = NULL;
+	e->len = len;
+	strcpy(e->topic, topic);
+	e->payload = len ? e->topic + tlen + 1 : NULL;
+	if (len) {
+		memcpy(e->payload, payload, len);
+		/* as libmosquitto does */
+		e->payload[len] = 0;
+	}
+	*s.echolast = e;
+	s.echolast = &e->next;
+
+	printf("%.3lf %c %s%s%.*s\n", replay_wall(), retain ? 'R' : 'M', topic,
+			len ? " " : "", len, (const char *)payload);
+}
@@ -0,0 +1,37 @@
+#ifndef _replay_h_
+#define _replay_h_
+
+#include <time.h>
+
+struct mosquitto;
+struct mosquitto_message;
+
+/* replay an MQTT trace on a simulated clock, as fast as possible
+ * The trace has 1 event per line, in order of TIME,
+ * the wall clock time in seconds since epoch:
+ *	TIME R TOPIC [PAYLOAD]	a retained message
+ *	TIME M TOPIC [PAYLOAD]	a live message
+ *	TIME J NEWTIME		the wall clock is set to NEWTIME
+ *	TIME E			end of the replay
+ * Empty lines and lines starting with # are skipped.
+ * Once started, wallclock() and libt_now() follow the simulated clock,
+ * which starts at the first TIME.
+ */
+extern void replay_init(const char *file);
+
+/* advance the simulated clock to the next event: a trace line,
+ * a libt timeout, or wall clock time @wakeup (0 for none),
+ * and pass the messages that are due to @msg
+ * Our own publishes are passed back first, without advancing the clock.
+ * returns 1 when the wall clock was set, -1 at the end of the replay
+ */
+extern int replay_step(time_t wakeup,
+		void (*msg)(struct mosquitto *mosq, void *dat, const struct mosquitto_message *msg),
+		void *dat);
+
+/* write a publish to stdout, in the trace format, for pubq_flush_to(),
+ * and queue it to pass it back as the broker does: without retain flag
+ */
+extern void replay_pub(const char *topic, const void *payload, int len, int retain);
+
+#endif
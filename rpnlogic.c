@@ -0,0 +1,174 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "rpnlogic.h"
+
+static int rpn_push(struct stack *st, double value)
+{
+	if (st->n >= st->s) {
+		st->s = st->s ? st->s*2 : 16;
+		st->v = realloc(st->v, sizeof(*st->v)*st->s);
+		if (!st->v) {
+			syslog(LOG_ERR, "realloc rpn stack %u: %s", st->s, strerror(errno));
+			exit(1);
+		}
+	}
+	st->v[st->n++] = value;
+	return 0;
+}
+
+static int rpn_need(struct stack *st, int n)
+{
+	if (st->n < n) {
+		syslog(LOG_WARNING, "rpn: stack underflow");
+		return -1;
+	}
+	return 0;
+}
+
+static int rpn_do_const(struct stack *st, struct rpn *me)
+{
+	return rpn_push(st, me->value);
+}
+
+static int rpn_do_env(struct stack *st, struct rpn *me)
+{
+	return rpn_push(st, rpn_lookup_env(me->topic, me));
+}
+
+/* a binary operator pops b, and replaces a with the result */
+#define RPN_BINOP(name, expr) \
+static int rpn_do_##name(struct stack *st, struct rpn *me) \
+{ \
+	double a, b; \
+	\
+	if (rpn_need(st, 2)) \
+		return -1; \
+	b = st->v[--st->n]; \
+	a = st->v[st->n-1]; \
+	st->v[st->n-1] = (expr); \
+	return 0; \
+}
+
+RPN_BINOP(add, a + b)
+RPN_BINOP(sub, a - b)
+RPN_BINOP(mul, a * b)
+RPN_BINOP(div, a / b)
+RPN_BINOP(mod, (long)b ? (long)a % (long)b : 0)
+RPN_BINOP(eq, a == b)
+RPN_BINOP(ne, a != b)
+RPN_BINOP(lt, a < b)
+RPN_BINOP(gt, a > b)
+RPN_BINOP(le, a <= b)
+RPN_BINOP(ge, a >= b)
+RPN_BINOP(and, a && b)
+RPN_BINOP(or, a || b)
+
+static int rpn_do_not(struct stack *st, struct rpn *me)
+{
+	if (rpn_need(st, 1))
+		return -1;
+	st->v[st->n-1] = !st->v[st->n-1];
+	return 0;
+}
+
+static const struct {
+	const char *str;
+	int (*run)(struct stack *st, struct rpn *me);
+} rpn_ops[] = {
+	{ "+", rpn_do_add, },
+	{ "-", rpn_do_sub, },
+	{ "*", rpn_do_mul, },
+	{ "/", rpn_do_div, },
+	{ "%", rpn_do_mod, },
+	{ "==", rpn_do_eq, },
+	{ "!=", rpn_do_ne, },
+	{ "<", rpn_do_lt, },
+	{ ">", rpn_do_gt, },
+	{ "<=", rpn_do_le, },
+	{ ">=", rpn_do_ge, },
+	{ "&&", rpn_do_and, },
+	{ "and", rpn_do_and, },
+	{ "||", rpn_do_or, },
+	{ "or", rpn_do_or, },
+	{ "!", rpn_do_not, },
+	{ "not", rpn_do_not, },
+	{ },
+};
+
+void rpn_free_chain(struct rpn *rpn)
+{
+	struct rpn *next;
+
+	for (; rpn; rpn = next) {
+		next = rpn->next;
+		free(rpn->topic);
+		free(rpn);
+	}
+}
+
+struct rpn *rpn_parse(const char *cstr, void *dat)
+{
+	struct rpn *first = NULL, **plast = &first, *rpn;
+	char *str, *tok, *saved, *end;
+	int j;
+
+	str = strdup(cstr);
+	if (!str)
+		return NULL;
+	for (tok = strtok_r(str, " \t", &saved); tok; tok = strtok_r(NULL, " \t", &saved)) {
+		rpn = malloc(sizeof(*rpn));
+		if (!rpn)
+			goto fail;
+		memset(rpn, 0, sizeof(*rpn));
+		rpn->dat = dat;
+		*plast = rpn;
+		plast = &rpn->next;
+
+		if (*tok == '$' && tok[1]) {
+			rpn->topic = strdup(tok+1);
+			rpn->run = rpn_do_env;
+			continue;
+		}
+		rpn->value = strtod(tok, &end);
+		if (end > tok && !*end) {
+			rpn->run = rpn_do_const;
+			continue;
+		}
+		for (j = 0; rpn_ops[j].str; ++j) {
+			if (!strcmp(tok, rpn_ops[j].str)) {
+				rpn->run = rpn_ops[j].run;
+				break;
+			}
+		}
+		if (!rpn->run) {
+			syslog(LOG_WARNING, "rpn: unknown token '%s'", tok);
+			goto fail;
+		}
+	}
+	free(str);
+	return first;
+fail:
+	free(str);
+	rpn_free_chain(first);
+	return NULL;
+}
+
+int rpn_run(struct stack *st, struct rpn *rpn)
+{
+	int ret;
+
+	for (; rpn; rpn = rpn->next) {
+		ret = rpn->run(st, rpn);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+void rpn_stack_reset(struct stack *st)
+{
+	st->n = 0;
+}
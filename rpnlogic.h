@@ -0,0 +1,42 @@
+#ifndef _rpnlogic_h_
+#define _rpnlogic_h_
+
+/* evaluation stack, reused between runs */
+struct stack {
+	double *v;
+	int n;
+	int s;
+};
+
+/* a parsed program is a chain of elements */
+struct rpn {
+	struct rpn *next;
+	int (*run)(struct stack *st, struct rpn *me);
+	/* constant */
+	double value;
+	/* name of a $-lookup */
+	char *topic;
+	/* as passed to rpn_parse() */
+	void *dat;
+	/* for the user of rpn_lookup_env(), to cache its lookup */
+	void *cookie;
+};
+
+/* parse a program of whitespace separated tokens:
+ * numbers, $NAME lookups and the operators
+ * + - * / % == != < > <= >= && and || or ! not
+ * returns NULL for an empty or invalid program
+ */
+extern struct rpn *rpn_parse(const char *cstr, void *dat);
+extern void rpn_free_chain(struct rpn *rpn);
+
+/* run @rpn on @st, returns 0 on success */
+extern int rpn_run(struct stack *st, struct rpn *rpn);
+extern void rpn_stack_reset(struct stack *st);
+
+/* provided by the user of rpnlogic */
+extern double rpn_lookup_env(const char *str, struct rpn *rpn);
+/* for elements that complete later, @dat as passed to rpn_parse() */
+extern void rpn_run_again(void *dat);
+
+#endif
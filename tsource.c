@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+
+#include "lib/libt.h"
+#include "common.h"
+#include "tsource.h"
+
+#ifndef TFD_TIMER_CANCEL_ON_SET
+#define TFD_TIMER_CANCEL_ON_SET (1 << 1)
+#endif
+
+/* without deadline, stay armed to detect clock changes */
+#define IDLE_WAKEUP	(86400*365)
+
+static struct {
+	int fd;
+	int precise;
+	double coalesce;
+	double slack;
+	time_t wall;
+	/* the armed wakeup, -1 to rearm */
+	double armed;
+} s = {
+	.fd = -1,
+	.armed = -1,
+};
+
+int tsource_init(void)
+{
+	s.fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (s.fd < 0) {
+		syslog(LOG_ERR, "timerfd_create: %s", strerror(errno));
+		exit(1);
+	}
+	return s.fd;
+}
+
+static void set_timerslack(double secs)
+{
+	/* 0 restores the default slack */
+	if (prctl(PR_SET_TIMERSLACK, (unsigned long)(secs*1e9), 0, 0, 0) < 0)
+		syslog(LOG_WARNING, "prctl timerslack %.3lfs: %s", secs, strerror(errno));
+}
+
+void tsource_precise(void)
+{
+	s.precise = 1;
+	s.coalesce = 0;
+	s.slack = 0;
+	/* the timerfd does not wake up early */
+	libt_set_early(0);
+	set_timerslack(1e-9);
+}
+
+void tsource_coalesce(double secs)
+{
+	s.coalesce = secs;
+}
+
+void tsource_slack(double secs)
+{
+	s.slack = secs;
+	set_timerslack(secs);
+}
+
+void tsource_set_wall(time_t t)
+{
+	s.wall = t;
+}
+
+void tsource_arm(void)
+{
+	double now, next, wake, ticks;
+	struct itimerspec spec = {};
+
+	if (s.fd < 0)
+		return;
+	now = wallclock();
+	/* the libt timeout, on the wall clock */
+	next = libt_next_wakeup();
+	if (next >= 0)
+		next = now + (next > libt_now() ? next - libt_now() : 0);
+
+	if (s.wall <= 0)
+		wake = next;
+	else if (next < 0)
+		wake = s.wall;
+	else if (next < s.wall)
+		/* 1 wakeup serves both within the slack */
+		wake = (s.wall - next <= s.slack) ? s.wall : next;
+	else
+		wake = (next - s.wall <= s.slack) ? next : s.wall;
+
+	if (wake < 0)
+		wake = now + IDLE_WAKEUP;
+	else if (s.coalesce > 0 && wake > now) {
+		/* deadlines that are due now do not wait for the grid */
+		ticks = (uint64_t)(wake / s.coalesce);
+		if (ticks * s.coalesce < wake)
+			++ticks;
+		wake = ticks * s.coalesce;
+	}
+
+	/* an armed wakeup may be that much late */
+	if (s.armed >= 0 && wake - s.armed < (s.precise ? 1e-6 : 1e-3) &&
+			s.armed - wake < (s.precise ? 1e-6 : 1e-3))
+		return;
+	spec.it_value.tv_sec = (time_t)wake;
+	spec.it_value.tv_nsec = (wake - spec.it_value.tv_sec) * 1e9;
+	if (spec.it_value.tv_nsec >= 1000000000)
+		spec.it_value.tv_nsec = 999999999;
+	if (timerfd_settime(s.fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL) < 0) {
+		syslog(LOG_ERR, "timerfd_settime: %s", strerror(errno));
+		exit(1);
+	}
+	s.armed = wake;
+}
+
+int tsource_read(void)
+{
+	uint64_t val;
+	int ret;
+
+	/* the next tsource_arm() rearms */
+	s.armed = -1;
+	ret = read(s.fd, &val, sizeof(val));
+	if (ret < 0 && errno == ECANCELED)
+		return TSOURCE_CHANGED;
+	if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+		syslog(LOG_ERR, "read timerfd: %s", strerror(errno));
+		exit(1);
+	}
+	if (s.wall > 0 && s.wall <= wallclock())
+		return TSOURCE_DUE;
+	return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef _tsource_h_
+#define _tsource_h_
+
+#include <time.h>
+
+/* the timer source of a daemon
+ * All deadlines share 1 CLOCK_REALTIME timerfd: a wall clock deadline,
+ * i.e. the next alarm, and the earliest libt timeout.
+ * The timerfd also detects when the wall clock is set.
+ * Without tsource_init(), i.e. in a replay, nothing is armed.
+ */
+extern int tsource_init(void);
+
+/* sub-msec wakeups with the lowest timer slack, no coalescing */
+extern void tsource_precise(void);
+/* wake up on multiples of @secs of the wall clock only,
+ * so deadlines close to each other share 1 wakeup
+ */
+extern void tsource_coalesce(double secs);
+/* delay a wakeup up to @secs to serve the other deadline too.
+ * This is the timer slack of the process as well.
+ */
+extern void tsource_slack(double secs);
+
+/* set the wall clock deadline, 0 for none */
+extern void tsource_set_wall(time_t t);
+
+/* arm the timerfd for the next deadline, call before sleeping */
+extern void tsource_arm(void);
+
+/* read the readable timerfd, returns a mask of */
+#define TSOURCE_DUE	1	/* the wall clock deadline passed */
+#define TSOURCE_CHANGED	2	/* the wall clock was set */
+extern int tsource_read(void);
+
+#endif